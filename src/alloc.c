@@ -3,9 +3,13 @@
 #include <stdlib.h>  // malloc(), etc
 #include "alloc.h"
 
+static __thread unsigned long alloc_count = 0;  // Allocations made by this thread
+
 // A malloc() which prints an error and dies if the request cannot be satisfied.
 void *xmalloc(size_t size)
 {
+  alloc_count++;
+
   void *ptr = malloc(size);
   if (ptr)
     return ptr;
@@ -25,6 +29,8 @@ void *xmalloc_zero(size_t size)
 // A realloc() which prints an error and dies if the request cannot be satisfied.
 void *xrealloc(void *ptr, size_t size)
 {
+  alloc_count++;
+
   void *newptr = realloc(ptr, size);
   if (newptr)
     return newptr;
@@ -33,6 +39,13 @@ void *xrealloc(void *ptr, size_t size)
   abort();
 }
 
+// Returns the number of calls this thread has made to xmalloc() and
+//  xrealloc(), for benchmarking.
+unsigned long alloc_get_count(void)
+{
+  return alloc_count;
+}
+
 // Wrapper for free().
 void xfree(void *ptr)
 {
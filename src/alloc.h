@@ -8,4 +8,6 @@ void *xmalloc_zero(size_t size);
 void *xrealloc(void *ptr, size_t size);
 void  xfree(void *ptr);
 
+unsigned long alloc_get_count(void);
+
 #endif
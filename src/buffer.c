@@ -60,6 +60,28 @@ void buffer_resize(buffer *b, size_t size)
   return;
 }
 
+// Shrinks the buffer's allocation towards the given size, without losing any
+//  stored data.
+void buffer_shrink(buffer *b, size_t size)
+{
+  if (size < b->length)
+    size = b->length;
+  if (size < 1)
+    size = 1;
+
+  if (size >= b->size)
+    return;  // Nothing to do
+
+  buffer_compact(b);
+
+  b->size = size;
+  b->data = xrealloc(b->data, size);
+
+  log_printf(LOG_LEVEL_DEBUG, "Buffer %p shrink to %zd\n", b, size);
+
+  return;
+}
+
 // Ensures we have at least the given number of bytes of slack space at the end of the buffer.
 void buffer_ensure_slack(buffer *b, size_t new_slack)
 {
@@ -68,6 +90,13 @@ void buffer_ensure_slack(buffer *b, size_t new_slack)
   if (cur_slack >= new_slack)
     return;  // Nothing to do
 
+  // Reuse space already consumed at the front, if that is enough
+  if ((cur_slack + b->position) >= new_slack)
+  {
+    buffer_compact(b);
+    return;
+  }
+
   buffer_resize(b, b->size + (new_slack - cur_slack));
 }
 
@@ -118,6 +147,21 @@ ssize_t buffer_write_bytes(buffer *b, const uint8_t *bytes, size_t size)
   return size;
 }
 
+// Gets room for at least the given number of bytes at the end of the buffer,
+//  so that they can be written there directly. Returns a pointer to it.
+uint8_t *buffer_get_write_space(buffer *b, size_t size)
+{
+  buffer_ensure_slack(b, size);
+
+  return b->data + b->position + b->length;
+}
+
+// Records bytes written to the space from buffer_get_write_space().
+void buffer_add_written_bytes(buffer *b, size_t size)
+{
+  b->length += size;
+}
+
 // Writes a single byte into the buffer.
 // Returns the number of bytes added.
 ssize_t buffer_write_byte(buffer *b, uint8_t byte)
@@ -201,21 +245,13 @@ int buffer_find_first_byte_in_set(buffer *b, uint8_t *set, size_t setlen, uint8_
 {
   uint8_t *p = b->data + b->position;
 
-  for (int i = 0; i < b->length; i++)
-  {
-    uint8_t byte = *p++;
-    for (int s = 0; s < setlen; s++)
-    {
-      if (byte == set[s])
-      {
-        if (found)
-          *found = byte;
-        return i;
-      }
-    }
-  }
+  size_t i = bytescan_find_set(p, b->length, set, setlen);
+  if (i == b->length)
+    return -1;  // Not found
 
-  return -1;  // Not found
+  if (found)
+    *found = p[i];
+  return i;
 }
 
 // Like buffer_find_byte(), but the start position and length of the search
@@ -237,6 +273,22 @@ int buffer_find_byte_within(buffer *b, uint8_t byte, int position, size_t length
   return (p - (b->data + b->position));
 }
 
+// Scans a header line starting at the given position, finding its LF, its
+//  colon delimiter and whether it contains a backslash in one pass. The
+//  offsets filled in are relative to the current position, like the other
+//  search functions, and are the buffer length where nothing was found.
+void buffer_scan_header_line(buffer *b, int position, bytescan_line *line)
+{
+  // Bounds check
+  if ((position < 0) || (position > b->length))
+    abort();
+
+  bytescan_header_line(b->data + b->position + position, b->length - position, line);
+
+  line->lf    += position;
+  line->colon += position;
+}
+
 // Append the given bytes from the buffer to the end of a bytestring. The
 //  bytes in the buffer are not consumed.
 void buffer_append_bytestring(buffer *b, bytestring *bs, int position, size_t length)
@@ -251,6 +303,16 @@ void buffer_append_bytestring(buffer *b, bytestring *bs, int position, size_t le
   return;
 }
 
+// Copies bytes out of the buffer, without consuming them.
+void buffer_copy_bytes(buffer *b, uint8_t *dest, int position, size_t length)
+{
+  // Bounds check
+  if ((position < 0) || ((position + length) > b->length))
+    abort();
+
+  memcpy(dest, b->data + b->position + position, length);
+}
+
 // Discard the given number of bytes on the reader side.
 void buffer_consume(buffer *b, int count)
 {
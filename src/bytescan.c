@@ -0,0 +1,325 @@
+#include <string.h>  // memchr()
+#include <assert.h>  // assert()
+
+#include "ministompd.h"
+
+// Scanning is done with SSE2 on x86-64, where it is always available, and
+//  with AVX2 where the CPU has it. Other platforms scan a byte at a time.
+#if defined(__x86_64__)
+#define BYTESCAN_X86
+#include <immintrin.h>
+#endif
+
+// Bytes that have to be escaped in header keys and values
+static const bool escapable_table[256] =
+{
+  ['\x0A'] = true,
+  ['\x0D'] = true,
+  [':']    = true,
+  ['\\']   = true
+};
+
+// -- Scalar --
+
+static size_t bytescan_find_set_scalar(const uint8_t *p, size_t length, const uint8_t *set, size_t setlen)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    for (size_t s = 0; s < setlen; s++)
+    {
+      if (p[i] == set[s])
+        return i;
+    }
+  }
+
+  return length;  // Not found
+}
+
+static size_t bytescan_find_escapable_scalar(const uint8_t *p, size_t length, size_t start)
+{
+  for (size_t i = start; i < length; i++)
+  {
+    if (escapable_table[p[i]])
+      return i;
+  }
+
+  return length;  // Not found
+}
+
+static void bytescan_header_line_scalar(const uint8_t *p, size_t length, bytescan_line *line, size_t start)
+{
+  for (size_t i = start; i < length; i++)
+  {
+    uint8_t byte = p[i];
+    if (byte == '\x0A')
+    {
+      line->lf = i;
+      return;
+    }
+    else if ((byte == ':') && (line->colon == length))
+      line->colon = i;
+    else if (byte == '\\')
+      line->backslash = true;
+  }
+
+  line->lf = length;
+}
+
+// Applies the LF, colon and backslash masks for one block of a header line.
+//  Returns true once the LF has been found.
+static inline bool bytescan_line_masks(bytescan_line *line, size_t length, size_t offset, uint32_t lfmask, uint32_t colonmask, uint32_t bsmask)
+{
+  // Only bytes before the LF belong to the line
+  bool done = (lfmask != 0);
+  if (done)
+  {
+    int lfbit = __builtin_ctz(lfmask);
+    uint32_t before = (1u << lfbit) - 1;
+    colonmask &= before;
+    bsmask    &= before;
+    line->lf = offset + lfbit;
+  }
+
+  if (colonmask && (line->colon == length))
+    line->colon = offset + __builtin_ctz(colonmask);
+  if (bsmask)
+    line->backslash = true;
+
+  return done;
+}
+
+#ifdef BYTESCAN_X86
+
+// -- SSE2 --
+
+static size_t bytescan_find_set_sse2(const uint8_t *p, size_t length, const uint8_t *set, size_t setlen)
+{
+  __m128i needles[BYTESCAN_SET_MAX];
+  for (size_t s = 0; s < setlen; s++)
+    needles[s] = _mm_set1_epi8(set[s]);
+
+  size_t i = 0;
+  for (; (i + 16) <= length; i += 16)
+  {
+    __m128i block = _mm_loadu_si128((const __m128i *) (p + i));
+    __m128i hits = _mm_cmpeq_epi8(block, needles[0]);
+    for (size_t s = 1; s < setlen; s++)
+      hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[s]));
+
+    uint32_t mask = _mm_movemask_epi8(hits);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+
+  return i + bytescan_find_set_scalar(p + i, length - i, set, setlen);
+}
+
+// Header keys and values are mostly short, so the fixed set of escapable
+//  bytes is compared against directly, and the tail goes by table lookup.
+static size_t bytescan_find_escapable_sse2(const uint8_t *p, size_t length)
+{
+  const __m128i lf    = _mm_set1_epi8('\x0A');
+  const __m128i cr    = _mm_set1_epi8('\x0D');
+  const __m128i colon = _mm_set1_epi8(':');
+  const __m128i bs    = _mm_set1_epi8('\\');
+
+  size_t i = 0;
+  for (; (i + 16) <= length; i += 16)
+  {
+    __m128i block = _mm_loadu_si128((const __m128i *) (p + i));
+    __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, lf), _mm_cmpeq_epi8(block, cr)),
+                                _mm_or_si128(_mm_cmpeq_epi8(block, colon), _mm_cmpeq_epi8(block, bs)));
+
+    uint32_t mask = _mm_movemask_epi8(hits);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+
+  return bytescan_find_escapable_scalar(p, length, i);
+}
+
+static void bytescan_header_line_sse2(const uint8_t *p, size_t length, bytescan_line *line)
+{
+  const __m128i lf    = _mm_set1_epi8('\x0A');
+  const __m128i colon = _mm_set1_epi8(':');
+  const __m128i bs    = _mm_set1_epi8('\\');
+
+  size_t i = 0;
+  for (; (i + 16) <= length; i += 16)
+  {
+    __m128i block = _mm_loadu_si128((const __m128i *) (p + i));
+    uint32_t lfmask    = _mm_movemask_epi8(_mm_cmpeq_epi8(block, lf));
+    uint32_t colonmask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, colon));
+    uint32_t bsmask    = _mm_movemask_epi8(_mm_cmpeq_epi8(block, bs));
+    if (bytescan_line_masks(line, length, i, lfmask, colonmask, bsmask))
+      return;
+  }
+
+  bytescan_header_line_scalar(p, length, line, i);
+}
+
+// -- AVX2 --
+//
+// Each routine clears the upper halves of the YMM registers on every way out,
+//  as the SSE code that runs afterwards, in the tails here or in the caller,
+//  would otherwise pay for the AVX/SSE transition on every instruction. The
+//  compiler only does this for us when optimising.
+
+__attribute__((target("avx2")))
+static size_t bytescan_find_set_avx2(const uint8_t *p, size_t length, const uint8_t *set, size_t setlen)
+{
+  __m256i needles[BYTESCAN_SET_MAX];
+  for (size_t s = 0; s < setlen; s++)
+    needles[s] = _mm256_set1_epi8(set[s]);
+
+  size_t i = 0;
+  uint32_t mask = 0;
+  for (; (i + 32) <= length; i += 32)
+  {
+    __m256i block = _mm256_loadu_si256((const __m256i *) (p + i));
+    __m256i hits = _mm256_cmpeq_epi8(block, needles[0]);
+    for (size_t s = 1; s < setlen; s++)
+      hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, needles[s]));
+
+    mask = _mm256_movemask_epi8(hits);
+    if (mask)
+      break;
+  }
+
+  _mm256_zeroupper();
+
+  if (mask)
+    return i + __builtin_ctz(mask);
+
+  return i + bytescan_find_set_sse2(p + i, length - i, set, setlen);
+}
+
+__attribute__((target("avx2")))
+static size_t bytescan_find_escapable_avx2(const uint8_t *p, size_t length)
+{
+  const __m256i lf    = _mm256_set1_epi8('\x0A');
+  const __m256i cr    = _mm256_set1_epi8('\x0D');
+  const __m256i colon = _mm256_set1_epi8(':');
+  const __m256i bs    = _mm256_set1_epi8('\\');
+
+  size_t i = 0;
+  uint32_t mask = 0;
+  for (; (i + 32) <= length; i += 32)
+  {
+    __m256i block = _mm256_loadu_si256((const __m256i *) (p + i));
+    __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, lf), _mm256_cmpeq_epi8(block, cr)),
+                                   _mm256_or_si256(_mm256_cmpeq_epi8(block, colon), _mm256_cmpeq_epi8(block, bs)));
+
+    mask = _mm256_movemask_epi8(hits);
+    if (mask)
+      break;
+  }
+
+  _mm256_zeroupper();
+
+  if (mask)
+    return i + __builtin_ctz(mask);
+
+  return i + bytescan_find_escapable_sse2(p + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static void bytescan_header_line_avx2(const uint8_t *p, size_t length, bytescan_line *line)
+{
+  const __m256i lf    = _mm256_set1_epi8('\x0A');
+  const __m256i colon = _mm256_set1_epi8(':');
+  const __m256i bs    = _mm256_set1_epi8('\\');
+
+  size_t i = 0;
+  bool done = false;
+  for (; !done && ((i + 32) <= length); i += 32)
+  {
+    __m256i block = _mm256_loadu_si256((const __m256i *) (p + i));
+    uint32_t lfmask    = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, lf));
+    uint32_t colonmask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, colon));
+    uint32_t bsmask    = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, bs));
+    done = bytescan_line_masks(line, length, i, lfmask, colonmask, bsmask);
+  }
+
+  _mm256_zeroupper();
+
+  if (!done)
+    bytescan_header_line_scalar(p, length, line, i);
+}
+
+#endif
+
+// -- Dispatch --
+
+typedef size_t bytescan_func_find_set(const uint8_t *p, size_t length, const uint8_t *set, size_t setlen);
+typedef size_t bytescan_func_find_escapable(const uint8_t *p, size_t length);
+typedef void   bytescan_func_header_line(const uint8_t *p, size_t length, bytescan_line *line);
+
+#ifdef BYTESCAN_X86
+static bytescan_func_find_set       *find_set_impl       = bytescan_find_set_sse2;
+static bytescan_func_find_escapable *find_escapable_impl = bytescan_find_escapable_sse2;
+static bytescan_func_header_line    *header_line_impl    = bytescan_header_line_sse2;
+#else
+static size_t bytescan_find_escapable_generic(const uint8_t *p, size_t length)
+{
+  return bytescan_find_escapable_scalar(p, length, 0);
+}
+
+static void bytescan_header_line_generic(const uint8_t *p, size_t length, bytescan_line *line)
+{
+  bytescan_header_line_scalar(p, length, line, 0);
+}
+
+static bytescan_func_find_set       *find_set_impl       = bytescan_find_set_scalar;
+static bytescan_func_find_escapable *find_escapable_impl = bytescan_find_escapable_generic;
+static bytescan_func_header_line    *header_line_impl    = bytescan_header_line_generic;
+#endif
+
+// Picks the widest scanning code the CPU supports. Must be called before any
+//  shard threads are started.
+void bytescan_init(void)
+{
+#ifdef BYTESCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    find_set_impl       = bytescan_find_set_avx2;
+    find_escapable_impl = bytescan_find_escapable_avx2;
+    header_line_impl    = bytescan_header_line_avx2;
+  }
+#endif
+}
+
+// Returns the offset of the first byte that is in the given set, or the
+//  length if there is none. The set may hold up to BYTESCAN_SET_MAX bytes.
+size_t bytescan_find_set(const uint8_t *p, size_t length, const uint8_t *set, size_t setlen)
+{
+  assert((setlen > 0) && (setlen <= BYTESCAN_SET_MAX));
+
+  if (setlen == 1)
+  {
+    // The C library's search is vectorised already
+    const uint8_t *found = memchr(p, set[0], length);
+    return found ? (size_t) (found - p) : length;
+  }
+
+  return (*find_set_impl)(p, length, set, setlen);
+}
+
+// Returns the offset of the first byte needing escaping in a header key or
+//  value, or the length if there is none.
+size_t bytescan_find_escapable(const uint8_t *p, size_t length)
+{
+  return (*find_escapable_impl)(p, length);
+}
+
+// Finds the end of a header line, along with its colon delimiter and whether
+//  it has any escape sequences, in a single pass.
+void bytescan_header_line(const uint8_t *p, size_t length, bytescan_line *line)
+{
+  line->lf        = length;
+  line->colon     = length;
+  line->backslash = false;
+
+  (*header_line_impl)(p, length, line);
+}
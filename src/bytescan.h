@@ -0,0 +1,23 @@
+#include <stdlib.h>   // size_t
+#include <stdint.h>   // uint8_t
+#include <stdbool.h>
+
+#ifndef MINISTOMPD_BYTESCAN_H
+#define MINISTOMPD_BYTESCAN_H
+
+#define BYTESCAN_SET_MAX 8  // Largest byte set that can be searched for
+
+// Where the structural bytes of a header line are, from one pass over it
+typedef struct
+{
+  size_t lf;         // Offset of the first LF, or the scanned length if there is none
+  size_t colon;      // Offset of the first colon before the LF, or the scanned length if there is none
+  bool   backslash;  // A backslash comes before the LF
+} bytescan_line;
+
+void   bytescan_init(void);
+size_t bytescan_find_set(const uint8_t *p, size_t length, const uint8_t *set, size_t setlen);
+size_t bytescan_find_escapable(const uint8_t *p, size_t length);
+void   bytescan_header_line(const uint8_t *p, size_t length, bytescan_line *line);
+
+#endif
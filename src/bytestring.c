@@ -1,5 +1,6 @@
 #include <string.h>  // memcpy(), memchr()
 #include <ctype.h>   // isprint()
+#include <assert.h>  // assert()
 
 #include "ministompd.h"
 #include "bytestring_printf.h"
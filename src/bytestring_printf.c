@@ -134,7 +134,7 @@ static bool parse_fmt_spec(const char *fmt, struct fmt_spec *fs, int *length)
 
 static const char *generate_fmt_spec(const struct fmt_spec *fs)
 {
-  static bytestring *fmt = NULL;
+  static __thread bytestring *fmt = NULL;  // One per thread, as shards format concurrently
   if (fmt == NULL)
   {
     fmt = bytestring_new(64);  // Reasonable size for format specifiers
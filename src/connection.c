@@ -1,18 +1,103 @@
-#include <sys/time.h>  // gettimeofday()
 #include <errno.h>
+#include <stddef.h>  // offsetof()
+#include <string.h>  // memcpy()
 #include <assert.h>  // assert()
-#include <inttypes.h>  // PRIx32
+#include <inttypes.h>  // PRIx32, PRIu64
+#include <sys/socket.h>  // shutdown()
+#include <sys/ioctl.h>   // ioctl(), FIONREAD
+#include <netinet/in.h>  // IPPROTO_TCP
+#include <linux/tcp.h>   // TCP_INFO, struct tcp_info
 
 #include "ministompd.h"
 
+static struct connection_watermarks default_watermarks =
+{
+  .output_high = DEFAULT_OUTPUT_HIGH_WATER,
+  .output_low  = DEFAULT_OUTPUT_LOW_WATER,
+  .queued_high = DEFAULT_QUEUED_HIGH_WATER,
+  .queued_low  = DEFAULT_QUEUED_LOW_WATER,
+  .queued_max  = DEFAULT_QUEUED_MAX
+};
+
+// Closes the underlying fd. With the io_uring engine, the socket is shut
+//  down first so that operations still in flight on it terminate.
+static void connection_close_fd(connection *c)
+{
+  if (c->uring)
+    shutdown(c->fd, SHUT_RDWR);
+
+  close(c->fd);
+}
+
 // Abort the connection due to a socket error.
 static void connection_abort(connection *c, int error)
 {
   c->status = CONNECTION_STATUS_CLOSED;
-  close(c->fd);
+  connection_close_fd(c);
 
-  if (c->error != 0)
+  if (c->error == 0)
     c->error = error;
+
+  connection_touch(c);
+}
+
+// Gives up on a connection that hasn't logged in within the time limit.
+static void connection_login_timeout(timer *t, void *data)
+{
+  connection *c = data;
+
+  if (c->status == CONNECTION_STATUS_LOGIN)
+  {
+    log_printf(LOG_LEVEL_INFO, "Connection %p timed out waiting for login.\n", c);
+    connection_abort(c, ETIMEDOUT);
+  }
+}
+
+// Checks that something arrived from the client during the last heartbeat
+//  period, plus some grace for network delays.
+static void connection_check_heartbeat(timer *t, void *data)
+{
+  connection *c = data;
+
+  if (c->status != CONNECTION_STATUS_CONNECTED)
+    return;
+
+  if (!c->hb_read)
+  {
+    log_printf(LOG_LEVEL_INFO, "Connection %p missed its incoming heartbeat.\n", c);
+    connection_abort(c, ETIMEDOUT);
+    return;
+  }
+
+  c->hb_read = false;
+  timerwheel_schedule(c->shard->timers, t, t->expiry + c->inheartbeat + HEARTBEAT_MISS_GRACE);
+}
+
+// Sends a heartbeat if nothing else has been written lately. This runs at
+//  twice the negotiated rate, so an idle connection sees no gap longer than
+//  the negotiated period.
+static void connection_send_heartbeat(timer *t, void *data)
+{
+  connection *c = data;
+
+  if (c->status != CONNECTION_STATUS_CONNECTED)
+    return;
+
+  if (!c->hb_written && (buffer_get_length(c->outbuffer) == 0) && !frameserializer_has_work_frames(c->frameserializer))
+  {
+    buffer_write_byte(c->outbuffer, '\n');
+    connection_touch(c);
+  }
+
+  c->hb_written = false;
+  timerwheel_schedule(c->shard->timers, t, t->expiry + (c->outheartbeat / 2));
+}
+
+// Sets the watermarks given to new connections. Must be called before any
+//  shard threads are started.
+void connection_set_default_watermarks(const struct connection_watermarks *wm)
+{
+  default_watermarks = *wm;
 }
 
 connection *connection_new(enum connection_status status, int fd)
@@ -21,8 +106,7 @@ connection *connection_new(enum connection_status status, int fd)
   connection *c = xmalloc(sizeof(connection));
 
   // Get connection timestamp
-  struct timeval connecttime;
-  gettimeofday(&connecttime, NULL);
+  struct timespec connecttime = loopclock_now();
 
   // Fill in fields
   c->status          = status;
@@ -33,6 +117,9 @@ connection *connection_new(enum connection_status status, int fd)
   c->outheartbeat    = 0;
   c->readtime        = connecttime;
   c->writetime       = connecttime;
+  c->hb_read         = false;
+  c->hb_written      = false;
+  c->read_size       = NETWORK_READ_SIZE;
   c->inbuffer        = buffer_new(4096);
   c->outbuffer       = buffer_new(4096);
   c->frameparser     = frameparser_new();
@@ -42,6 +129,33 @@ connection *connection_new(enum connection_status status, int fd)
   c->subs_by_client_id = hash_new(16);
   c->subs_by_server_id = hash_new(16);
 
+  c->bundle      = NULL;
+  c->bundle_slot = -1;
+  c->events      = 0;
+  c->touched     = false;
+  c->deferred    = false;
+  c->shard       = NULL;
+
+  c->uring         = NULL;
+  c->sendbuffer    = NULL;
+  c->uring_ops     = 0;
+  c->uring_sending = false;
+  c->uring_stalled = 0;
+
+  c->watermarks     = default_watermarks;
+  c->throttled      = false;
+  c->throttle_count = 0;
+
+  c->coalesce        = CONNECTION_COALESCE_LATENCY;
+  c->coalesce_chosen = false;
+  c->frames_out      = 0;
+  c->writes_out      = 0;
+
+  frameserializer_set_queue_max(c->frameserializer, c->watermarks.queued_max);
+
+  timer_init(&c->recv_timer, connection_login_timeout, c);
+  timer_init(&c->send_timer, connection_send_heartbeat, c);
+
   return c;
 }
 
@@ -57,19 +171,63 @@ void connection_free(connection *c)
 {
   // TODO: Assertion failure if we have any subscriptions
 
+  if (c->shard)
+  {
+    timerwheel_cancel(c->shard->timers, &c->recv_timer);
+    timerwheel_cancel(c->shard->timers, &c->send_timer);
+  }
+
   frameparser_free(c->frameparser);
   frameserializer_free(c->frameserializer);
   buffer_free(c->inbuffer);
   buffer_free(c->outbuffer);
+  if (c->sendbuffer)
+    buffer_free(c->sendbuffer);
   hash_free(c->subs_by_client_id);
   hash_free(c->subs_by_server_id);
   xfree(c);
 }
 
+// Picks output coalescing from the preferences of the subscribed queues,
+//  unless the client chose for itself. Latency wins over throughput, as
+//  holding back output would break the promise made to a latency queue. If
+//  no queue has a preference, the connection keeps the mode it has.
+static void connection_update_coalesce(connection *c)
+{
+  if (c->coalesce_chosen)
+    return;
+
+  int count = hash_get_itemcount(c->subs_by_server_id);
+
+  const bytestring *keys[count];
+  hash_get_keys(c->subs_by_server_id, keys, count);
+
+  qc_coalesce coalesce = QC_COALESCE_ANY;
+  for (int i = 0; i < count; i++)
+  {
+    subscription *sub = hash_get(c->subs_by_server_id, keys[i]);
+    qc_coalesce wanted = sub->queue->config->coalesce;
+
+    if (wanted == QC_COALESCE_LATENCY)
+    {
+      coalesce = QC_COALESCE_LATENCY;
+      break;
+    }
+    else if (wanted == QC_COALESCE_THROUGHPUT)
+      coalesce = QC_COALESCE_THROUGHPUT;
+  }
+
+  if (coalesce == QC_COALESCE_LATENCY)
+    c->coalesce = CONNECTION_COALESCE_LATENCY;
+  else if (coalesce == QC_COALESCE_THROUGHPUT)
+    c->coalesce = CONNECTION_COALESCE_THROUGHPUT;
+}
+
 bool connection_subscribe(connection *c, subscription *sub)
 {
   hash_add(c->subs_by_client_id, sub->client_id, sub);
   hash_add(c->subs_by_server_id, sub->server_id, sub);
+  connection_update_coalesce(c);
   return true;
 }
 
@@ -83,48 +241,252 @@ bool connection_unsubscribe(connection *c, subscription *sub)
   removed = hash_remove(c->subs_by_server_id, sub->server_id);
   assert(removed == sub);
 
+  connection_update_coalesce(c);
   return true;
 }
 
 void connection_close(connection *c)
 {
   c->status = CONNECTION_STATUS_CLOSED;
-  close(c->fd);
+  connection_close_fd(c);
+
+  connection_touch(c);
+}
+
+// Arms the login timeout. Called once the connection belongs to a shard.
+void connection_start_timers(connection *c)
+{
+  timerwheel *tw = c->shard->timers;
+  timerwheel_schedule(tw, &c->recv_timer, tw->now + LIMIT_LOGIN_TIMEOUT);
 }
 
-// Pull waiting input in to the connection's buffer.
-void connection_pump_input(connection *c)
+// Parses one heartbeat period from a "heart-beat" header value, advancing
+//  the position past it. Returns -1 on a malformed value.
+static int connection_parse_heartbeat_period(const uint8_t *p, size_t len, size_t *pos)
 {
-  int readcount = 0;
+  int period = 0;
+  size_t start = *pos;
 
-  // Try to read some data
-  readcount = buffer_input_fd(c->inbuffer, c->fd, NETWORK_READ_SIZE);
-  if (readcount == 0)
+  while ((*pos < len) && (p[*pos] >= '0') && (p[*pos] <= '9'))
   {
-    connection_close(c);
+    if (period > ((INT32_MAX - 9) / 10))
+      return -1;  // Overflow
+
+    period = (period * 10) + (p[*pos] - '0');
+    (*pos)++;
+  }
+
+  return (*pos == start) ? -1 : period;
+}
+
+// Works out the heartbeat periods from the client's "heart-beat" header
+//  value, within the server's limits. Returns false if it is malformed.
+bool connection_negotiate_heartbeat(connection *c, const bytestring *value)
+{
+  const uint8_t *p = bytestring_get_bytes(value);
+  size_t len = bytestring_get_length(value);
+  size_t pos = 0;
+
+  // Format is "cx,cy": the client can send every cx ms, and wants to hear
+  //  from the server every cy ms. Zero means never.
+  int cx = connection_parse_heartbeat_period(p, len, &pos);
+  if ((cx < 0) || (pos >= len) || (p[pos++] != ','))
+    return false;
+
+  int cy = connection_parse_heartbeat_period(p, len, &pos);
+  if ((cy < 0) || (pos != len))
+    return false;
+
+  c->outheartbeat = (cy == 0) ? 0 : ((cy < LIMIT_HEARTBEAT_FREQ_MIN) ? LIMIT_HEARTBEAT_FREQ_MIN : cy);
+  c->inheartbeat  = (cx == 0) ? 0 : ((cx < DEFAULT_HEARTBEAT_FREQ) ? DEFAULT_HEARTBEAT_FREQ : cx);
+
+  return true;
+}
+
+// Sets output coalescing from a "coalesce" header value on CONNECT: either
+//  "latency" or "throughput". Returns false on anything else.
+bool connection_negotiate_coalesce(connection *c, const bytestring *value)
+{
+  if (bytestring_cmp_string(value, "latency") == 0)
+    c->coalesce = CONNECTION_COALESCE_LATENCY;
+  else if (bytestring_cmp_string(value, "throughput") == 0)
+    c->coalesce = CONNECTION_COALESCE_THROUGHPUT;
+  else
+    return false;
+
+  c->coalesce_chosen = true;
+  return true;
+}
+
+// Replaces the login timeout with the negotiated heartbeat timers, once the
+//  connection is established.
+void connection_start_heartbeats(connection *c)
+{
+  timerwheel *tw = c->shard->timers;
+
+  timerwheel_cancel(tw, &c->recv_timer);
+
+  if (c->inheartbeat > 0)
+  {
+    c->hb_read = false;
+    c->recv_timer.func = connection_check_heartbeat;
+    timerwheel_schedule(tw, &c->recv_timer, tw->now + c->inheartbeat + HEARTBEAT_MISS_GRACE);
+  }
+
+  if (c->outheartbeat > 0)
+    timerwheel_schedule(tw, &c->send_timer, tw->now + (c->outheartbeat / 2));
+}
+
+// Flags the connection for an event interest update on its bundle. Should be
+//  called whenever its status, pending output or queued frames may have
+//  changed outside of its own event handling.
+void connection_touch(connection *c)
+{
+  if (c->bundle)
+    connectionbundle_touch_connection(c->bundle, c);
+}
+
+// Pull waiting input in to the connection's buffer. Reads carry on until the
+//  socket is drained or 'budget' bytes have been read. The read size grows
+//  while reads keep coming back full, and shrinks again once traffic quietens.
+//  Returns the number of bytes read.
+size_t connection_pump_input(connection *c, size_t budget)
+{
+  size_t total = 0;
+  bool after_body = false;
+
+  // With the io_uring engine, input arrives through completions instead
+  if (c->uring)
+    return 0;
+
+  size_t size = c->read_size;
+  for (int n = 0; n < NETWORK_READ_LOOP_MAX; n++)
+  {
+    // Once everything buffered has been parsed, the rest of a content-length
+    //  body is read straight into its frame
+    uint8_t *space;
+    size_t spacelen;
+    bool direct = (buffer_get_length(c->inbuffer) == 0) && frameparser_get_body_space(c->frameparser, &space, &spacelen);
+
+    // Try to read some data
+    ssize_t readcount;
+    if (direct)
+    {
+      if (spacelen > (budget - total))
+        spacelen = budget - total;
+
+      readcount = read(c->fd, space, spacelen);
+      if (readcount > 0)
+        frameparser_add_body_bytes(c->frameparser, readcount);
+    }
+    else
+      readcount = buffer_input_fd(c->inbuffer, c->fd, size);
+
+    if (readcount == 0)
+    {
+      connection_close(c);
+      break;
+    }
+    else if (readcount < 0)
+    {
+      int error = errno;
+      if ((error != EAGAIN) && (error != EWOULDBLOCK))
+        connection_abort(c, error);  // Unexpected error
+      break;
+    }
+
+    total += readcount;
+
+    if (direct)
+    {
+      if ((readcount < spacelen) || (total >= budget))
+        break;  // Drained, or out of budget
+
+      // The space given is full. If that was only one slice of a long body,
+      //  the next pass reads into the slice after it. Otherwise the body is
+      //  complete, so read just enough to take in what follows it, and let
+      //  the parser see the next frame's headers before reading on, so that
+      //  its body can be read directly too.
+      size = NETWORK_READ_SIZE;
+      after_body = true;
+      continue;
+    }
+    else if (after_body)
+      break;
+
+    // A short read means the socket has been drained
+    if (readcount < size)
+      break;
+    else if (total >= budget)
+      break;  // Leave the rest for the next wakeup
+
+    // Read came back full, so ask for more next time
+    if (c->read_size < NETWORK_READ_SIZE_MAX)
+      c->read_size *= 2;
+
+    // Size the next read to what is actually waiting, which also saves a
+    //  read() just to see EAGAIN
+    int waiting;
+    if (ioctl(c->fd, FIONREAD, &waiting) == -1)
+      waiting = c->read_size;
+    else if (waiting == 0)
+      break;  // Drained
+
+    size = (waiting < NETWORK_READ_SIZE_MAX) ? waiting : NETWORK_READ_SIZE_MAX;
+    if (size < c->read_size)
+      size = c->read_size;
   }
-  else if (readcount < 0)
+
+  // Quiet wakeup: step the read size back down, and give back buffer memory
+  //  grown for earlier bursts
+  if ((c->read_size > NETWORK_READ_SIZE) && (total < (c->read_size / 4)))
   {
-    int error = errno;
-    if ((error != EAGAIN) && (error != EWOULDBLOCK))
-      connection_abort(c, error);  // Unexpected error
+    c->read_size /= 2;
+    buffer_shrink(c->inbuffer, c->read_size * 2);
   }
 
   // Update read timestamp, if needed
-  if (readcount > 0)
-    gettimeofday(&c->readtime, NULL);
+  if (total > 0)
+  {
+    c->readtime = loopclock_now();
+    c->hb_read = true;
+  }
+
+  return total;
 }
 
-// Push waiting output out to the socket.
-void connection_pump_output(connection *c)
+// Reads up to 'budget' more bytes of a content-length body that the parser
+//  has caught up to, and is waiting on. Returns the number of bytes read.
+size_t connection_pump_body(connection *c, size_t budget)
+{
+  uint8_t *space;
+  size_t spacelen;
+
+  if (c->uring || (buffer_get_length(c->inbuffer) > 0) || !frameparser_get_body_space(c->frameparser, &space, &spacelen))
+    return 0;
+
+  return connection_pump_input(c, budget);
+}
+
+// Writes waiting output to the socket. If 'more' is set, the kernel holds
+//  back a partly filled last segment, as more output follows this tick.
+static void connection_write_output(connection *c, bool more)
 {
   int writecount = 0;
 
-  // If we have data waiting to go out, try writing it
-  size_t outbuflen = buffer_get_length(c->outbuffer);
-  if (outbuflen > 0)
+  // With the io_uring engine, hand the output over for a batched send
+  if (c->uring)
   {
-    writecount = buffer_output_fd(c->outbuffer, c->fd, outbuflen);
+    uring_send(c->uring, c);
+    connection_update_throttle(c);
+    return;
+  }
+
+  // If we have data waiting to go out, try writing it. Large bodies go
+  //  straight from their frames, alongside the buffered bytes.
+  if ((buffer_get_length(c->outbuffer) > 0) || frameserializer_has_work_frames(c->frameserializer))
+  {
+    writecount = frameserializer_output_fd(c->frameserializer, c->outbuffer, c->fd, more);
     if (writecount < 0)
     {
       int error = errno;
@@ -137,8 +499,104 @@ void connection_pump_output(connection *c)
 
   // Update write timestamp, if needed
   if (writecount > 0)
-    gettimeofday(&c->writetime, NULL);
+  {
+    c->writetime = loopclock_now();
+    c->hb_written = true;
+    c->writes_out++;
+  }
+
+  connection_update_throttle(c);
+}
+
+// Push waiting output out to the socket. A connection coalescing for
+//  throughput holds on to it until the end of the tick, unless enough has
+//  built up to fill segments.
+void connection_pump_output(connection *c)
+{
+  bool coalescing = (c->coalesce == CONNECTION_COALESCE_THROUGHPUT);
+  if (coalescing && (buffer_get_length(c->outbuffer) < COALESCE_FLUSH_BYTES))
+  {
+    connection_touch(c);  // Flushed at the end of the tick
+    connection_update_throttle(c);
+    return;
+  }
+
+  connection_write_output(c, coalescing);
+}
+
+// Returns true iff the connection has output waiting to go out, whether
+//  serialized or not.
+bool connection_has_pending_output(connection *c)
+{
+  return (buffer_get_length(c->outbuffer) > 0) || frameserializer_has_work_frames(c->frameserializer);
+}
+
+// Pushes out all waiting output, at the end of a tick.
+void connection_flush_output(connection *c)
+{
+  connection_write_output(c, false);
+}
+
+// Handles a receive completed by the io_uring engine. The 'res' argument is
+//  the byte count or negated errno, as from read().
+void connection_complete_input(connection *c, const uint8_t *data, int res)
+{
+  // Already closed? Operations draining after shutdown() end up here.
+  if (c->status == CONNECTION_STATUS_CLOSED)
+    return;
 
+  if (res == 0)
+  {
+    connection_close(c);
+  }
+  else if (res < 0)
+  {
+    connection_abort(c, -res);  // Unexpected error
+  }
+  else
+  {
+    // Body bytes go straight into a content-length frame, if the parser has
+    //  caught up with the buffer
+    uint8_t *space;
+    size_t spacelen;
+    if ((buffer_get_length(c->inbuffer) == 0) && frameparser_get_body_space(c->frameparser, &space, &spacelen))
+    {
+      size_t count = (res < spacelen) ? res : spacelen;
+      memcpy(space, data, count);
+      frameparser_add_body_bytes(c->frameparser, count);
+      data += count;
+      res  -= count;
+    }
+
+    if (res > 0)
+      buffer_write_bytes(c->inbuffer, data, res);
+    c->readtime = loopclock_now();
+    c->hb_read = true;
+  }
+}
+
+// Handles a send of the send buffer completed by the io_uring engine. The
+//  'res' argument is the byte count or negated errno, as from write().
+void connection_complete_output(connection *c, int res)
+{
+  if (c->status == CONNECTION_STATUS_CLOSED)
+    return;
+
+  if (res < 0)
+  {
+    if (res == -EPIPE)
+      connection_close(c);
+    else
+      connection_abort(c, -res);  // Unexpected error
+  }
+  else
+  {
+    buffer_consume(c->sendbuffer, res);
+    c->writetime = loopclock_now();
+    c->hb_written = true;
+    c->writes_out++;
+    connection_update_throttle(c);
+  }
 }
 
 // Puts the connection in error status and queues an ERROR frame for output.
@@ -148,6 +606,7 @@ void connection_send_error_message(connection *c, frame *causalframe, bytestring
 {
   // Set error connection status
   c->status = CONNECTION_STATUS_STOMP_ERROR;
+  connection_touch(c);
 
   // Create an error frame containing the message
   frame *errorframe = frame_new();
@@ -161,7 +620,7 @@ void connection_send_error_message(connection *c, frame *causalframe, bytestring
   if (causalframe)
   {
     // Original 'receipt' header is included as the error's 'receipt-id' header
-    const bytestring *receipt = headerbundle_get_header_value_by_str(frame_get_headerbundle(causalframe), "receipt");
+    const bytestring *receipt = headerbundle_get_header_value_by_atom(frame_get_headerbundle(causalframe), HDR_RECEIPT);
     if (receipt)
     {
       headerbundle_append_header(errorheaders, bytestring_new_from_string("receipt-id"), bytestring_dup(receipt));;
@@ -169,7 +628,10 @@ void connection_send_error_message(connection *c, frame *causalframe, bytestring
   }
 
   // Enqueue frame
-  if (!frameserializer_enqueue_frame(c->frameserializer, errorframe, NULL))
+  bool queued = frameserializer_enqueue_frame(c->frameserializer, errorframe, NULL);
+  frame_free(errorframe);  // The serializer holds it now, if it was queued
+
+  if (!queued)
   {
     log_printf(LOG_LEVEL_ERROR, "Outgoing queue is full, dropping error frame.\n");
     connection_close(c);
@@ -179,9 +641,88 @@ void connection_send_error_message(connection *c, frame *causalframe, bytestring
   return;
 }
 
+// Re-evaluates output backpressure against the connection's watermarks. On
+//  dropping back below the low watermarks, the queues of the connection's
+//  subscriptions are asked to route any frames they held back.
+void connection_update_throttle(connection *c)
+{
+  size_t output = buffer_get_length(c->outbuffer);
+  if (c->sendbuffer)
+    output += buffer_get_length(c->sendbuffer);
+
+  int queued = frameserializer_get_work_frame_count(c->frameserializer);
+
+  if (!c->throttled)
+  {
+    if ((output < c->watermarks.output_high) && (queued < c->watermarks.queued_high) && !frameserializer_is_full(c->frameserializer))
+      return;  // Still below both high watermarks, and taking frames
+
+    __atomic_store_n(&c->throttled, true, __ATOMIC_RELAXED);
+    c->throttle_count++;
+    log_printf(LOG_LEVEL_DEBUG, "Connection %p throttled (%zu bytes, %d frames pending).\n", c, output, queued);
+    return;
+  }
+
+  if ((output > c->watermarks.output_low) || (queued > c->watermarks.queued_low))
+    return;  // Not drained enough yet
+
+  __atomic_store_n(&c->throttled, false, __ATOMIC_RELAXED);
+  log_printf(LOG_LEVEL_DEBUG, "Connection %p unthrottled.\n", c);
+
+  // Resume routing on each subscribed queue
+  int count = hash_get_itemcount(c->subs_by_server_id);
+
+  const bytestring *keys[count];
+  hash_get_keys(c->subs_by_server_id, keys, count);
+
+  for (int i = 0; i < count; i++)
+  {
+    subscription *sub = hash_get(c->subs_by_server_id, keys[i]);
+    shard_pump_queue(sub->queue);
+  }
+}
+
+// Returns true iff the connection is above a high watermark. Safe to call
+//  from any shard.
+bool connection_is_throttled(connection *c)
+{
+  return __atomic_load_n(&c->throttled, __ATOMIC_RELAXED);
+}
+
+// Gets the number of TCP segments carrying data that the kernel has sent on
+//  the connection, leaving out retransmissions. Pure ACKs and retransmits
+//  depend on the peer and the network rather than on how output was
+//  grouped into writes, so they would only blur the figure. Returns false if
+//  the kernel is too old to tell.
+bool connection_get_data_segments_out(connection *c, uint64_t *segments)
+{
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  if (getsockopt(c->fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+    return false;
+  else if (len < (offsetof(struct tcp_info, tcpi_data_segs_out) + sizeof(info.tcpi_data_segs_out)))
+    return false;  // Kernel too old to count data segments
+
+  *segments = info.tcpi_data_segs_out;
+  if (*segments > info.tcpi_total_retrans)
+    *segments -= info.tcpi_total_retrans;
+
+  return true;
+}
+
 void connection_dump(connection *c)
 {
   printf("Connection %p fd %d status %d\n", c, c->fd, c->status);
+  printf("  Output: %zu bytes buffered, %d frames queued, %s (throttled %" PRIu64 " times)\n",
+    buffer_get_length(c->outbuffer), frameserializer_get_work_frame_count(c->frameserializer),
+    c->throttled ? "throttled" : "flowing", c->throttle_count);
+
+  uint64_t segments;
+  printf("  Coalescing for %s: %" PRIu64 " frames in %" PRIu64 " writes",
+    (c->coalesce == CONNECTION_COALESCE_THROUGHPUT) ? "throughput" : "latency", c->frames_out, c->writes_out);
+  if ((c->frames_out > 0) && connection_get_data_segments_out(c, &segments))
+    printf(", %.2f data segments per frame", (double) segments / c->frames_out);
+  printf("\n");
 
   int count = hash_get_itemcount(c->subs_by_server_id);
 
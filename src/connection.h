@@ -1,5 +1,6 @@
 #include "queuetypes.h"
-#include <sys/time.h>  // struct timeval
+#include <time.h>      // struct timespec
+#include <stdint.h>    // uint32_t
 
 #ifndef MINISTOMPD_CONNECTION_H
 #define MINISTOMPD_CONNECTION_H
@@ -17,6 +18,30 @@ enum connection_version
   CONNECTION_VERSION_1_2  // STOMP 1.2
 };
 
+// How output is grouped into writes. Either way Nagle's algorithm is off, so
+//  nothing waits on the peer's ACKs once it is written.
+enum connection_coalesce
+{
+  CONNECTION_COALESCE_LATENCY,    // Output is written as soon as it is serialized
+  CONNECTION_COALESCE_THROUGHPUT  // Output is held to the end of the tick, or until enough builds up to fill segments
+};
+
+struct connectionbundle;
+struct uring;
+struct shard;
+
+// Output backpressure thresholds. Above either high watermark, no new frames
+//  are routed to the connection's subscriptions until both measures are back
+//  down to their low watermarks.
+struct connection_watermarks
+{
+  size_t output_high;  // Pending output bytes at which deliveries stop
+  size_t output_low;   // Pending output bytes at which deliveries resume
+  int    queued_high;  // Frames waiting to be serialized at which deliveries stop
+  int    queued_low;   // Frames waiting to be serialized at which deliveries resume
+  int    queued_max;   // Frames waiting to be serialized beyond which deliveries are refused
+};
+
 struct connection
 {
   enum connection_status  status;           // Current status
@@ -25,8 +50,13 @@ struct connection
   int                     fd;               // Underlying fd
   int                     inheartbeat;      // Negotiated incoming heartbeat frequency
   int                     outheartbeat;     // Negotiated outgoing heartbeat frequency
-  struct timeval          readtime;         // Time of last read() returning data from underlying socket
-  struct timeval          writetime;        // Time of last successful write() to underlying socket
+  struct timespec         readtime;         // Time of last read() returning data from underlying socket
+  struct timespec         writetime;        // Time of last successful write() to underlying socket
+  bool                    hb_read;          // Data read since the last incoming heartbeat check
+  bool                    hb_written;       // Data written since the last outgoing heartbeat check
+  timer                   recv_timer;       // Login timeout, then incoming heartbeat checks
+  timer                   send_timer;       // Outgoing heartbeats
+  size_t                  read_size;        // Size of the next read, adapted to the connection's traffic
   buffer                 *inbuffer;         // Input buffer
   buffer                 *outbuffer;        // Output buffer
   frameparser            *frameparser;      // Frame parser
@@ -35,17 +65,53 @@ struct connection
   uint32_t                next_sub_server_id;  // Next sub_serverid for a subscription on this connection
   hash                   *subs_by_client_id;   // Subscription map (client id -> subscription)
   hash                   *subs_by_server_id;   // Subscription map (server id -> subscription)
+
+  struct connectionbundle *bundle;       // Bundle holding this connection, or NULL
+  int                      bundle_slot;  // Slot index within the bundle
+  uint32_t                 events;       // Epoll events currently registered for the fd
+  bool                     touched;      // Queued for an interest update on the bundle
+  bool                     deferred;     // Has buffered input left over for the next round
+  struct shard            *shard;        // Shard whose thread owns this connection
+
+  struct uring            *uring;          // io_uring engine doing this connection's I/O, or NULL
+  buffer                  *sendbuffer;     // Output owned by an in-flight io_uring send
+  int                      uring_ops;      // Count of io_uring operations in flight
+  bool                     uring_sending;  // An io_uring send is in flight
+  int                      uring_stalled;  // io_uring operations waiting for a free SQE
+
+  struct connection_watermarks watermarks;      // Output backpressure thresholds
+  bool                         throttled;       // Above a high watermark; read by other shards' routers
+  uint64_t                     throttle_count;  // Number of times the connection has been throttled
+
+  enum connection_coalesce coalesce;         // How output is grouped into writes
+  bool                     coalesce_chosen;  // Picked by the client on CONNECT, so queue preferences don't apply
+  uint64_t                 frames_out;       // Frames fully serialized
+  uint64_t                 writes_out;       // Writes that sent output to the socket
 };
 
+void              connection_set_default_watermarks(const struct connection_watermarks *wm);
 connection       *connection_new(enum connection_status status, int fd);
 void              connection_free(connection *c);
 const bytestring *connection_generate_subscription_server_id(connection *c);
 bool              connection_subscribe(connection *c, subscription *sub);
 bool              connection_unsubscribe(connection *c, subscription *sub);
 void              connection_close(connection *c);
-void              connection_pump_input(connection *c);
+void              connection_start_timers(connection *c);
+bool              connection_negotiate_heartbeat(connection *c, const bytestring *value);
+bool              connection_negotiate_coalesce(connection *c, const bytestring *value);
+void              connection_start_heartbeats(connection *c);
+void              connection_touch(connection *c);
+size_t            connection_pump_input(connection *c, size_t budget);
+size_t            connection_pump_body(connection *c, size_t budget);
 void              connection_pump_output(connection *c);
+bool              connection_has_pending_output(connection *c);
+void              connection_flush_output(connection *c);
+void              connection_complete_input(connection *c, const uint8_t *data, int res);
+void              connection_complete_output(connection *c, int res);
 void              connection_send_error_message(connection *c, frame *causalframe, bytestring *msg);
+void              connection_update_throttle(connection *c);
+bool              connection_is_throttled(connection *c);
+bool              connection_get_data_segments_out(connection *c, uint64_t *segments);
 void              connection_dump(connection *c);
 
 #endif
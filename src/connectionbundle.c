@@ -1,8 +1,28 @@
 #include <string.h>  // memset()
+#include <inttypes.h>  // PRIu64
+#include <sys/epoll.h>
 
 #include "ministompd.h"
 
-connectionbundle *connectionbundle_new(void)
+// Returns the set of epoll events the connection is currently interested in.
+static uint32_t connectionbundle_wanted_events(connection *c)
+{
+  uint32_t events = 0;
+
+  // Always watch for reading unless we're sending an error frame
+  if (c->status != CONNECTION_STATUS_STOMP_ERROR)
+    events |= EPOLLIN;
+
+  // Watch for writing if we have frames to serialize or if the write buffer is not empty
+  if (frameserializer_has_work_frames(c->frameserializer) || (buffer_get_length(c->outbuffer) > 0))
+    events |= EPOLLOUT;
+
+  return events;
+}
+
+// Creates a bundle. If an io_uring engine is supplied, connection I/O goes
+//  through it rather than through epoll readiness and read()/write().
+connectionbundle *connectionbundle_new(uring *u)
 {
   // Allocate memory
   connectionbundle *cb = xmalloc(sizeof(connectionbundle));
@@ -11,10 +31,22 @@ connectionbundle *connectionbundle_new(void)
   cb->size        = 16;  // A reasonable starting size
   cb->count       = 0;
   cb->connections = xmalloc(sizeof(connection *) * cb->size);
+  cb->touched     = list_new(16);
+  cb->reapable    = list_new(4);
+  cb->deferred    = list_new(16);
+  cb->uring       = u;
 
   // Clear initial slots
   memset(cb->connections, 0, sizeof(connection *) * cb->size);
 
+  // Create epoll instance
+  cb->epollfd = epoll_create1(EPOLL_CLOEXEC);
+  if (cb->epollfd == -1)
+  {
+    log_perror(LOG_LEVEL_ERROR, "epoll_create1()");
+    exit(1);
+  }
+
   return cb;
 }
 
@@ -43,32 +75,122 @@ void connectionbundle_add_connection(connectionbundle *cb, connection *c)
   cb->connections[slot] = c;
   cb->count++;
 
+  c->bundle      = cb;
+  c->bundle_slot = slot;
+
+  // The io_uring engine watches the connection by itself
+  if (cb->uring)
+  {
+    uring_add_connection(cb->uring, c);
+    return;
+  }
+
+  // Register interest in the connection's fd. This is done once; later
+  //  changes only toggle the event mask.
+  struct epoll_event ev;
+  ev.events   = connectionbundle_wanted_events(c);
+  ev.data.ptr = c;
+  if (epoll_ctl(cb->epollfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+  {
+    log_perror(LOG_LEVEL_ERROR, "epoll_ctl()");
+    exit(1);
+  }
+
+  c->events = ev.events;
+
   return;
 }
 
-// Marks fds for watching by a later select() call. Returns the highest known fd.
-int connectionbundle_mark_fds(connectionbundle *cb, int highfd, fd_set *readfds, fd_set *writefds)
+// Queues the connection to have its event interest re-evaluated by the next
+//  call to connectionbundle_update_interest(). Cheap to call repeatedly.
+void connectionbundle_touch_connection(connectionbundle *cb, connection *c)
 {
-  for (int s = 0; s < cb->size; s++)
+  if (c->touched)
+    return;  // Already queued
+
+  c->touched = true;
+  list_push(cb->touched, c);
+}
+
+// Re-evaluates the event interest of each touched connection, issuing an
+//  epoll_ctl() only for those whose interest actually changed. Touched
+//  connections which have closed are removed from the bundle and queued for
+//  reaping.
+void connectionbundle_update_interest(connectionbundle *cb)
+{
+  connection *c;
+  while ((c = list_pop(cb->touched)))
   {
-    connection *c = cb->connections[s];
-    if ((c == NULL) || (c->status == CONNECTION_STATUS_CLOSED))
+    c->touched = false;
+
+    // Closed connections leave the bundle once no io_uring operations
+    //  still refer to them. Closing the fd has already removed it from the
+    //  epoll set.
+    if (c->status == CONNECTION_STATUS_CLOSED)
+    {
+      if (c->uring_ops > 0)
+        continue;  // Will be touched again as the operations complete
+
+      // Don't leave a dangling reference behind
+      if (c->deferred)
+      {
+        list_remove(cb->deferred, list_search(cb->deferred, c));
+        c->deferred = false;
+      }
+
+      cb->connections[c->bundle_slot] = NULL;
+      cb->count--;
+      c->bundle = NULL;
+      list_push(cb->reapable, c);
       continue;
+    }
+    else if (cb->uring)
+      continue;  // No readiness interest to maintain
 
-    // Track the highest-numbered fd
-    if (highfd < c->fd)
-      highfd = c->fd;
+    uint32_t events = connectionbundle_wanted_events(c);
+    if (events == c->events)
+      continue;  // Nothing changed
 
-    // Always select for reading unless we're sending an error frame
-    if (c->status != CONNECTION_STATUS_STOMP_ERROR)
-      FD_SET(c->fd, readfds);
+    struct epoll_event ev;
+    ev.events   = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(cb->epollfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+    {
+      log_perror(LOG_LEVEL_ERROR, "epoll_ctl()");
+      exit(1);
+    }
 
-    // Select for writing if we have frames to serialize of if the write buffer is not empty
-    if (frameserializer_has_work_frames(c->frameserializer) || (buffer_get_length(c->outbuffer) > 0))
-      FD_SET(c->fd, writefds);
+    c->events = events;
   }
+}
+
+// Queues a connection that ran out of its frame budget with input still
+//  buffered, so that it gets handled again next round even if no new data
+//  arrives on its fd. Cheap to call repeatedly.
+void connectionbundle_defer_connection(connectionbundle *cb, connection *c)
+{
+  if (c->deferred)
+    return;  // Already queued
 
-  return highfd;
+  c->deferred = true;
+  list_push(cb->deferred, c);
+}
+
+// Returns the number of connections waiting for another round of input
+//  handling.
+int connectionbundle_get_deferred_count(connectionbundle *cb)
+{
+  return list_get_length(cb->deferred);
+}
+
+// Removes and returns the oldest deferred connection, or NULL if none.
+connection *connectionbundle_get_next_deferred_connection(connectionbundle *cb)
+{
+  connection *c = list_shift(cb->deferred);
+  if (c)
+    c->deferred = false;
+
+  return c;
 }
 
 cb_iter connectionbundle_iter_new(connectionbundle *cb)
@@ -92,48 +214,67 @@ connection *connectionbundle_get_next_connection(connectionbundle *cb, cb_iter *
   return NULL;  // No more connections
 }
 
-connection *connectionbundle_get_next_active_connection(connectionbundle *cb, cb_iter *iter, fd_set *readfds, fd_set *writefds)
+// Returns the next connection queued for an interest update, or NULL if
+//  none. The queue is not modified.
+connection *connectionbundle_get_next_touched_connection(connectionbundle *cb, cb_iter *iter)
 {
-  for (int s = *iter; s < cb->size; s++)
-  {
-    connection *c = cb->connections[s];
-    if (c == NULL)
-      continue;
+  if (*iter >= list_get_length(cb->touched))
+    return NULL;  // No more connections
 
-    if (FD_ISSET(c->fd, readfds) || FD_ISSET(c->fd, writefds))
-    {
-      *iter = s + 1;
-      return c;
-    }
-  }
+  return list_get_item(cb->touched, (*iter)++);
+}
 
-  return NULL;  // No more connections to check
+// Returns the next closed connection that has been removed from the bundle.
+//  Caller takes ownership of the returned connection. Returns NULL if there
+//  are no more connections to reap.
+connection *connectionbundle_reap_next_connection(connectionbundle *cb)
+{
+  return list_pop(cb->reapable);
 }
 
-// Finds the next closed connection in the bundle. Removes it from the bundle
-//  and returns it. Caller takes ownership of the returned connection. Returns
-//  NULL if there are no more connections to reap.
-connection *connectionbundle_reap_next_connection(connectionbundle *cb, cb_iter *iter)
+// Logs a summary of the bundle's connections and their output backpressure.
+void connectionbundle_dump_stats(connectionbundle *cb)
 {
-  for (int s = *iter; s < cb->size; s++)
+  int throttled = 0;
+  size_t output = 0;
+  uint64_t frames = 0;
+  uint64_t writes = 0;
+  uint64_t segments = 0;
+
+  connection *c;
+  cb_iter iter = connectionbundle_iter_new(cb);
+  while ((c = connectionbundle_get_next_connection(cb, &iter)))
   {
-    connection *c = cb->connections[s];
-    if ((c != NULL) && (c->status == CONNECTION_STATUS_CLOSED))
+    if (c->throttled)
+      throttled++;
+
+    output += buffer_get_length(c->outbuffer);
+
+    // Only connections whose segments can be counted go towards the ratio
+    uint64_t segs;
+    if (connection_get_data_segments_out(c, &segs))
     {
-      *iter = s + 1;
-      cb->connections[s] = NULL;
-      cb->count--;
-      return c;
+      frames   += c->frames_out;
+      writes   += c->writes_out;
+      segments += segs;
     }
   }
 
-  return NULL;  // No more connections to check
+  log_printf(LOG_LEVEL_INFO, "Bundle %p: %d connections, %d throttled, %d deferred, %zu bytes of output buffered\n",
+    cb, cb->count, throttled, list_get_length(cb->deferred), output);
+
+  if (frames > 0)
+    log_printf(LOG_LEVEL_INFO, "Bundle %p: %" PRIu64 " frames out in %" PRIu64 " writes and %" PRIu64 " data segments, %.2f data segments per frame\n",
+      cb, frames, writes, segments, (double) segments / frames);
 }
 
 // TODO: Clean up the constituent connections also
 void connectionbundle_free(connectionbundle *cb)
 {
+  close(cb->epollfd);
+  list_free(cb->touched);
+  list_free(cb->reapable);
+  list_free(cb->deferred);
   xfree(cb->connections);
   xfree(cb);
 }
-
@@ -1,22 +1,35 @@
+#include "list.h"
+#include "uring.h"
+
 #ifndef MINISTOMPD_CONNECTIONBUNDLE_H
 #define MINISTOMPD_CONNECTIONBUNDLE_H
 
-typedef struct
+typedef struct connectionbundle
 {
   int          size;         // Number of slots allocated
   int          count;        // Number of slots filled
   connection **connections;  // Array of pointers to connections
+  int          epollfd;      // Epoll instance watching the fds of all connections
+  list        *touched;      // Connections whose event interest must be re-evaluated
+  list        *reapable;     // Closed connections removed from the bundle, waiting to be reaped
+  list        *deferred;     // Connections with buffered input left over from the last round
+  uring       *uring;        // io_uring engine for connection I/O, or NULL to use read()/write()
 } connectionbundle;
 
 typedef int cb_iter;
 
-connectionbundle *connectionbundle_new(void);
+connectionbundle *connectionbundle_new(uring *u);
 void              connectionbundle_add_connection(connectionbundle *cb, connection *c);
-int               connectionbundle_mark_fds(connectionbundle *cb, int highfd, fd_set *readfds, fd_set *writefds);
+void              connectionbundle_touch_connection(connectionbundle *cb, connection *c);
+void              connectionbundle_update_interest(connectionbundle *cb);
+void              connectionbundle_defer_connection(connectionbundle *cb, connection *c);
+int               connectionbundle_get_deferred_count(connectionbundle *cb);
+connection       *connectionbundle_get_next_deferred_connection(connectionbundle *cb);
 cb_iter           connectionbundle_iter_new(connectionbundle *cb);
 connection       *connectionbundle_get_next_connection(connectionbundle *cb, cb_iter *iter);
-connection       *connectionbundle_get_next_active_connection(connectionbundle *cb, cb_iter *iter, fd_set *readfds, fd_set *writefds);
-connection       *connectionbundle_reap_next_connection(connectionbundle *cb, cb_iter *iter);
+connection       *connectionbundle_get_next_touched_connection(connectionbundle *cb, cb_iter *iter);
+connection       *connectionbundle_reap_next_connection(connectionbundle *cb);
+void              connectionbundle_dump_stats(connectionbundle *cb);
 void              connectionbundle_free(connectionbundle *cb);
 
 #endif
@@ -1,9 +1,28 @@
-#include <string.h> // strcmp()
+#include <string.h> // memcmp()
 
 #include "ministompd.h"
 
 struct frame_command_name_item {size_t length; const char *name;};
-struct frame_command_name_item *frame_command_names = NULL;  // Created lazily
+
+// Indexed by command code. Built at compile time, as it is shared by all shards.
+static const struct frame_command_name_item frame_command_names[CMD_CODE_COUNT] =
+{
+  {5,  "STOMP"},
+  {7,  "CONNECT"},
+  {9,  "CONNECTED"},
+  {4,  "SEND"},
+  {9,  "SUBSCRIBE"},
+  {11, "UNSUBSCRIBE"},
+  {5,  "BEGIN"},
+  {6,  "COMMIT"},
+  {5,  "ABORT"},
+  {3,  "ACK"},
+  {4,  "NACK"},
+  {10, "DISCONNECT"},
+  {7,  "MESSAGE"},
+  {7,  "RECEIPT"},
+  {5,  "ERROR"}
+};
 
 const char *frame_command_name(frame_command cmd)
 {
@@ -44,26 +63,62 @@ const char *frame_command_name(frame_command cmd)
   }
 }
 
+// Perfect hash of the command names, chosen so that no two commands share a
+//  slot. Found by searching small multipliers; if a command is ever added,
+//  the multipliers and table need to be worked out again.
+#define FRAME_COMMAND_HASH_SIZE 32
+#define FRAME_COMMAND_HASH(name, length) \
+ ((((length) * 1) + ((name)[0] * 4) + ((name)[(length) - 1] * 9)) & (FRAME_COMMAND_HASH_SIZE - 1))
+
+// Maps command hashes to command codes. Built at compile time, as it is
+//  shared by all shards.
+static const int8_t frame_command_hash[FRAME_COMMAND_HASH_SIZE] =
+{
+  CMD_NONE,
+  CMD_STOMP,
+  CMD_SUBSCRIBE,
+  CMD_RECEIPT,
+  CMD_NONE,
+  CMD_NONE,
+  CMD_COMMIT,
+  CMD_CONNECT,
+  CMD_MESSAGE,
+  CMD_NONE,
+  CMD_ACK,
+  CMD_BEGIN,
+  CMD_UNSUBSCRIBE,
+  CMD_NONE,
+  CMD_DISCONNECT,
+  CMD_NONE,
+  CMD_NONE,
+  CMD_NONE,
+  CMD_NONE,
+  CMD_NONE,
+  CMD_SEND,
+  CMD_NONE,
+  CMD_NONE,
+  CMD_NONE,
+  CMD_NONE,
+  CMD_CONNECTED,
+  CMD_NONE,
+  CMD_ERROR,
+  CMD_NONE,
+  CMD_ABORT,
+  CMD_NONE,
+  CMD_NACK
+};
+
 // Given a frame command name, returns the frame_command code. Returns
 //  CMD_NONE on unknown command names.
 frame_command frame_command_code(const uint8_t *name, size_t length)
 {
-  // If we haven't built the command name array yet, do it now
-  if (frame_command_names == NULL)
-  {
-    frame_command_names = xmalloc(CMD_CODE_COUNT * sizeof(struct frame_command_name_item));
-
-    for (int i = 0; i < CMD_CODE_COUNT; i++)
-    {
-      frame_command_names[i].name = frame_command_name(i);
-      frame_command_names[i].length = strlen(frame_command_names[i].name);
-    }
-  }
+  if (length == 0)
+    return CMD_NONE;
 
-  // Search for the command code
-  for (int i = 0; i < CMD_CODE_COUNT; i++)
-    if ((length == frame_command_names[i].length) && (memcmp(frame_command_names[i].name, name, length) == 0))
-      return (frame_command) i;
+  // The hash only picks a candidate, which still has to match in full
+  int i = frame_command_hash[FRAME_COMMAND_HASH(name, length)];
+  if ((i != CMD_NONE) && (length == frame_command_names[i].length) && (memcmp(frame_command_names[i].name, name, length) == 0))
+    return (frame_command) i;
 
   // Not found
   return CMD_NONE;
@@ -73,13 +128,22 @@ frame *frame_new(void)
 {
   frame *f = xmalloc(sizeof(frame));
 
+  f->refcount     = 1;
   f->command      = CMD_NONE;
   f->headerbundle = headerbundle_new();
   f->body         = NULL;
+  f->wire         = NULL;
 
   return f;
 }
 
+// Takes another reference to a frame. Returns the frame.
+frame *frame_ref(frame *f)
+{
+  __atomic_add_fetch(&f->refcount, 1, __ATOMIC_RELAXED);
+  return f;
+}
+
 frame_command frame_get_command(frame *f)
 {
   return f->command;
@@ -123,13 +187,20 @@ void frame_dump(frame *f)
     printf("(no body)\n");
 }
 
+// Drops a reference to a frame, freeing it once the last one goes.
 void frame_free(frame *f)
 {
+  if (__atomic_sub_fetch(&f->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+    return;  // Still held elsewhere
+
   headerbundle_free(f->headerbundle);
 
   if (f->body)
     bytestring_free(f->body);
 
+  if (f->wire)
+    wireimage_unref(f->wire);
+
   xfree(f);
 }
 
@@ -28,17 +28,24 @@ typedef enum
 
 #define CMD_NONE (-1)
 
+struct wireimage;
+
+// Refcounted, as a stored frame is also held by its queue's router, by
+//  deliveries and by serializers, which may be on other shards.
 typedef struct
 {
-  frame_command command;
-  headerbundle *headerbundle;
-  bytestring   *body;  // May be NULL if no body
+  int               refcount;
+  frame_command     command;
+  headerbundle     *headerbundle;
+  bytestring       *body;  // May be NULL if no body
+  struct wireimage *wire;  // Serialized form shared by broadcast deliveries, or NULL
 } frame;
 
 const char   *frame_command_name(frame_command cmd);
 frame_command frame_command_code(const uint8_t *name, size_t length);
 
 frame        *frame_new(void);
+frame        *frame_ref(frame *f);
 frame_command frame_get_command(frame *f);
 void          frame_set_command(frame *f, frame_command cmd);
 headerbundle *frame_get_headerbundle(frame *f);
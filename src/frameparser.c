@@ -1,107 +1,27 @@
 #include <stdbool.h>
+#include <string.h>  // memchr()
+#include <assert.h>  // assert()
 #include "ministompd.h"
 
-// Unescapes a bytestring according to the rules used for headers:
-//  "\r" => CR, "\n" => LF, "\c" => ":", "\\" => "\"
-// If the input bytestring is well-formed, it is consumed and a new bytestring
-//  is returned. If the input bytestring is malformed, it is not consumed and
-//  NULL is returned.
-static bytestring *unescape_header_bytestring(bytestring *in)
-{
-  bytestring *out = NULL;
-  bool success = true;
-  size_t inlen = bytestring_get_length(in);
-  int pos = 0;
-
-  // Handle trivial case of zero-length input
-  if (inlen == 0)
-    return in;
-
-  while (pos < inlen)
-  {
-    // Find next backslash
-    int bspos = bytestring_find_byte(in, '\\', pos);
-    if (bspos == -1)
-    {
-      // No backslash, can take the rest of the input verbatim
-      if (!out)
-        return in;  // No transforms needed, so just return the input string
-
-      // Create output string, if needed
-      if (!out)
-        out = bytestring_new(bytestring_get_length(in));
-
-      // Grab rest of input string
-      size_t count = inlen - pos;
-      bytestring_append_bytestring_fragment(out, in, pos, count);
-      pos += count;
-    }
-    else
-    {
-      // There was a backslash, so we'll need to do some transforming
-
-      // Create output string, if needed
-      if (!out)
-        out = bytestring_new(bytestring_get_length(in));
-
-      // Grab all characters before the backslash, if any
-      if (bspos > 0)
-      {
-        // Copy everything before the backslash
-        size_t count = bspos - pos;
-        bytestring_append_bytestring_fragment(out, in, pos, count);
-        pos += count;
-      }
-
-      // Process the character following the backslash
-      if (bytestring_get_length(in) == (bspos + 1))
-      {
-        success = false;  // There is no following character
-        break;
-      }
-      else
-      {
-        uint8_t c = bytestring_get_bytes(in)[bspos + 1];
-        if (c == '\\')
-          bytestring_append_byte(out, '\\');
-        else if (c == 'r')
-          bytestring_append_byte(out, '\x0D');  // CR
-        else if (c == 'n')
-          bytestring_append_byte(out, '\x0A');  // LF
-        else if (c == 'c')
-          bytestring_append_byte(out, ':');
-        else
-        {
-          success = false;  // Invalid escape sequence
-          break;
-        }
-
-        pos += 2;
-      }
-    }
-  }
-
-  // Handle errors
-  if (!success)
-  {
-    if (out)
-      bytestring_free(out);
-    return NULL;
-  }
-
-  // All done
-  bytestring_free(in);
-  return out;
-}
-
 frameparser *frameparser_new(void)
 {
   frameparser *fp = xmalloc(sizeof(frameparser));
 
   fp->state       = FP_STATE_IDLE;
   fp->length_left = FP_LENGTH_UNKNOWN;
+
+  fp->scan_pos       = 0;
+  fp->scan_colon     = -1;
+  fp->scan_backslash = false;
+
+  fp->header_pos   = 0;
+  fp->header_count = 0;
+  fp->header_size  = 16;  // Enough header lines for most frames
+  fp->header_lines = xmalloc(sizeof(struct fp_header_line) * fp->header_size);
+
   fp->cur_frame   = NULL;
-  fp->fin_frame   = NULL;
+  fp->fin_head    = 0;
+  fp->fin_count   = 0;
   fp->error       = NULL;
 
   return fp;
@@ -130,15 +50,30 @@ const bytestring *frameparser_get_error(frameparser *fp)
   return fp->error;
 }
 
-// Returns the next finished frame to the caller. Caller takes ownership of
-//  the frame.
+// Returns the next finished frame to the caller, or NULL if none is waiting.
+//  Caller takes ownership of the frame.
 frame *frameparser_get_frame(frameparser *fp)
 {
-  frame *f = fp->fin_frame;  // Could be NULL, if no finished frame is waiting
-  fp->fin_frame = NULL;
+  if (fp->fin_count == 0)
+    return NULL;
+
+  frame *f = fp->fin_frames[fp->fin_head];
+  fp->fin_head = (fp->fin_head + 1) % FP_FRAME_QUEUE_SIZE;
+  fp->fin_count--;
   return f;
 }
 
+// Fills in up to max finished frames, oldest first, and returns how many
+//  there were. Caller takes ownership of the frames.
+int frameparser_get_frames(frameparser *fp, frame **frames, int max)
+{
+  int count = 0;
+  while ((count < max) && (fp->fin_count > 0))
+    frames[count++] = frameparser_get_frame(fp);
+
+  return count;
+}
+
 // Called when we are done reading all the headers.
 void frameparser_parse_headers_complete(frameparser *fp)
 {
@@ -151,7 +86,7 @@ void frameparser_parse_headers_complete(frameparser *fp)
   }
 
   // There should be a body following, so check for a content-length header
-  const bytestring *bs = headerbundle_get_header_value_by_str(fp->cur_frame->headerbundle, "content-length");
+  const bytestring *bs = headerbundle_get_header_value_by_atom(fp->cur_frame->headerbundle, HDR_CONTENT_LENGTH);
   if (bs == NULL)
     fp->length_left = FP_LENGTH_UNKNOWN;  // No content-length, will have to read until NUL
   else
@@ -171,6 +106,12 @@ void frameparser_parse_headers_complete(frameparser *fp)
 
     log_printf(LOG_LEVEL_DEBUG, "Content-length is: %ld\n", value);
     fp->length_left = value;
+
+    // Make room for the body up front, so it rarely has to grow. Large
+    //  bodies only get a first slice, so that a content-length header alone
+    //  can't tie up memory; frameparser_get_body_space() grows them as the
+    //  bytes arrive.
+    bytestring_ensure_size(frame_ensure_body(fp->cur_frame), (value < FP_BODY_PREALLOC_MAX) ? value : FP_BODY_PREALLOC_MAX);
   }
 
   // Transition to body state
@@ -223,11 +164,15 @@ bool frameparser_parse_command(frameparser *fp, buffer *b)
   log_printf(LOG_LEVEL_DEBUG, "frameparser_parse_command\n");
   // Valid input in this state is a string followed by CR/LF or LF, which matches a known frame command
 
-  // Try to find LF line terminator
-  int lfpos = buffer_find_byte(b, '\x0A');
+  // Try to find LF line terminator, carrying on from where earlier calls
+  //  left off
+  size_t length = buffer_get_length(b);
+  int lfpos = buffer_find_byte_within(b, '\x0A', fp->scan_pos, length - fp->scan_pos);
   if (lfpos < 0)  // No LF yet?
   {
-    if (buffer_get_length(b) > LIMIT_FRAME_CMD_LINE_LEN)
+    fp->scan_pos = length;
+
+    if (length > LIMIT_FRAME_CMD_LINE_LEN)
       frameparser_set_error(fp, "Line length limit exceeded waiting for command");
 
     return false;  // No progress
@@ -240,19 +185,21 @@ bool frameparser_parse_command(frameparser *fp, buffer *b)
   if (buffer_get_byte(b, len - 1) == '\x0D')
     len--;
 
-  // Extract the command into a new bytestring
-  bytestring *bs = bytestring_new(len);
-  buffer_append_bytestring(b, bs, 0, len);
-  bytestring_dump(bs);
+  // Look up the command, copying it out of the buffer as it may wrap. No
+  //  command is anywhere near the line length limit, so longer lines
+  //  can't match.
+  frame_command cmd = CMD_NONE;
+  if (len <= LIMIT_FRAME_CMD_LINE_LEN)
+  {
+    uint8_t name[LIMIT_FRAME_CMD_LINE_LEN];
+    buffer_copy_bytes(b, name, 0, len);
+    log_printf(LOG_LEVEL_DEBUG, "Command: %.*s\n", len, (const char *) name);
+    cmd = frame_command_code(name, len);
+  }
 
   // Consume the current line
   buffer_consume(b, lfpos + 1);
-
-  // Find the command code for this command
-  frame_command cmd = frame_command_code(bytestring_get_bytes(bs), bytestring_get_length(bs));
-
-  // Clean up the bytestring
-  bytestring_free(bs);
+  fp->scan_pos = 0;
 
   // Make sure command is valid
   if (cmd == CMD_NONE)
@@ -273,6 +220,61 @@ bool frameparser_parse_command(frameparser *fp, buffer *b)
   return true;
 }
 
+// Called at the blank line ending the headers. Copies the header lines out
+//  of the buffer in one go, and adds headers to the frame as slices of the
+//  copy. Escaped keys and values are only checked here, and are unescaped
+//  when first read, so those that are just passed on never are. Returns
+//  false if a header is malformed.
+static bool frameparser_build_headers(frameparser *fp, buffer *b)
+{
+  headerblock *blk = headerblock_new(fp->header_pos, fp->header_count * 2);
+  buffer_copy_bytes(b, blk->data, 0, fp->header_pos);
+
+  headerbundle *hb = frame_get_headerbundle(fp->cur_frame);
+  headerbundle_set_block(hb, blk);
+
+  // Keys and values are escaped, apart from in CONNECT and CONNECTED frames
+  frame_command cmd = frame_get_command(fp->cur_frame);
+  bool unescape = ((cmd != CMD_CONNECT) && (cmd != CMD_CONNECTED));
+
+  for (int i = 0; i < fp->header_count; i++)
+  {
+    struct fp_header_line *line = &fp->header_lines[i];
+    const uint8_t *keybytes = blk->data + line->keypos;
+    const uint8_t *valbytes = blk->data + line->valpos;
+
+    int escaped = 0;
+    if (unescape && line->escaped)
+    {
+      if (memchr(keybytes, '\\', line->keylen))
+      {
+        if (!header_escapes_valid(keybytes, line->keylen))
+        {
+          frameparser_set_error(fp, "Invalid escape sequence in header name");
+          return false;
+        }
+        escaped |= HEADER_ESCAPED_KEY;
+      }
+
+      if (memchr(valbytes, '\\', line->vallen))
+      {
+        if (!header_escapes_valid(valbytes, line->vallen))
+        {
+          frameparser_set_error(fp, "Invalid escape sequence in header value");
+          return false;
+        }
+        escaped |= HEADER_ESCAPED_VAL;
+      }
+    }
+
+    bytestring *key = headerblock_slice(blk, line->keypos, line->keylen);
+    bytestring *val = headerblock_slice(blk, line->valpos, line->vallen);
+    headerbundle_append_escaped_header(hb, key, val, escaped);
+  }
+
+  return true;
+}
+
 // Parses a header line. Returns true iff progress was made.
 bool frameparser_parse_header(frameparser *fp, buffer *b)
 {
@@ -280,71 +282,94 @@ bool frameparser_parse_header(frameparser *fp, buffer *b)
   // Valid input in this state is either:
   // 1. CR/LF or LF alone, denoting the end of headers
   // 2. A key name, followed by a colon, followed by a value name, terminated with CR/LF or LF
-
-  // Try to find LF line terminator
-  int lfpos = buffer_find_byte(b, '\x0A');
-  if (lfpos < 0)  // No LF yet?
+  // Header lines are left in the buffer until the end of headers, and only
+  //  their positions are noted.
+
+  // Find the LF line terminator following the header lines already read,
+  //  along with the colon delimiter and any backslashes before it. Scanning
+  //  carries on from where earlier calls left off, so a line trickling in
+  //  is only scanned once.
+  int pos = fp->header_pos;
+  size_t length = buffer_get_length(b);
+  bytescan_line scan;
+  buffer_scan_header_line(b, fp->scan_pos, &scan);
+
+  if ((fp->scan_colon < 0) && (scan.colon < scan.lf))
+    fp->scan_colon = scan.colon;
+  if (scan.backslash)
+    fp->scan_backslash = true;
+
+  int lfpos = scan.lf;
+  if (lfpos == length)  // No LF yet?
   {
-    if (buffer_get_length(b) > LIMIT_FRAME_HEADER_LINE_LEN)
+    fp->scan_pos = length;
+
+    if ((length - pos) > LIMIT_FRAME_HEADER_LINE_LEN)
       frameparser_set_error(fp, "Line length limit exceeded waiting for header");
 
     return false;  // No progress
   }
-  else if (lfpos == 0)  // LF alone
-  {
-    buffer_consume(b, 1);
-    frameparser_parse_headers_complete(fp);
-    return true;
-  }
-  else if ((lfpos == 1) && (buffer_get_byte(b, 0) == '\x0D'))  // CR/LF alone
+
+  // Found the end of the line, so the next scan starts after it
+  int colonpos = fp->scan_colon;
+  bool backslash = fp->scan_backslash;
+  fp->scan_pos       = lfpos + 1;
+  fp->scan_colon     = -1;
+  fp->scan_backslash = false;
+
+  if ((lfpos == pos) || ((lfpos == (pos + 1)) && (buffer_get_byte(b, pos) == '\x0D')))  // LF or CR/LF alone
   {
-    buffer_consume(b, 2);
+    if (!frameparser_build_headers(fp, b))
+      return false;
+
+    buffer_consume(b, lfpos + 1);
+    fp->header_pos   = 0;
+    fp->header_count = 0;
+    fp->scan_pos     = 0;
+
     frameparser_parse_headers_complete(fp);
     return true;
   }
 
   // Figure out number of bytes in the line
-  int len = lfpos;
-  if (buffer_get_byte(b, len - 1) == '\x0D')
+  int len = lfpos - pos;
+  if (buffer_get_byte(b, lfpos - 1) == '\x0D')
     len--;
 
-  // Find the colon delimiter
-  int colonpos = buffer_find_byte_within(b, ':', 0, len);
-  if (colonpos < 0)  // No colon?
+  // Check the colon delimiter
+  if ((colonpos < 0) || (colonpos >= (pos + len)))  // No colon?
   {
     frameparser_set_error(fp, "Expected colon delimiter on header line");
     return false;
   }
-  else if (colonpos == 0)  // Starts with colon?
+  else if (colonpos == pos)  // Starts with colon?
   {
     frameparser_set_error(fp, "Header name has zero length");
     return false;
   }
 
-  // Extract the key
-  bytestring *key = bytestring_new(colonpos);
-  buffer_append_bytestring(b, key, 0, colonpos);
-
-  // Extract the value
-  bytestring *val = bytestring_new(len - colonpos - 1);
-  buffer_append_bytestring(b, val, colonpos + 1, len - colonpos - 1);
-
-  // Consume the current line
-  buffer_consume(b, lfpos + 1);
-
-  // Unescape the key and value if needed
-  frame_command cmd = frame_get_command(fp->cur_frame);
-  if ((cmd != CMD_CONNECT) && (cmd != CMD_CONNECTED))
+  // Make room to note the line's position
+  if (fp->header_count == fp->header_size)
   {
-    key = unescape_header_bytestring(key);
-    val = unescape_header_bytestring(val);
+    if (fp->header_count >= LIMIT_FRAME_HEADER_LINE_COUNT)
+    {
+      frameparser_set_error(fp, "Header count limit exceeded");
+      return false;
+    }
+
+    fp->header_size *= 2;
+    fp->header_lines = xrealloc(fp->header_lines, sizeof(struct fp_header_line) * fp->header_size);
   }
 
-  bytestring_dump(key);
-  bytestring_dump(val);
+  struct fp_header_line *line = &fp->header_lines[fp->header_count++];
+  line->keypos  = pos;
+  line->keylen  = colonpos - pos;
+  line->valpos  = colonpos + 1;
+  line->vallen  = (pos + len) - colonpos - 1;
+  line->escaped = backslash;
 
-  headerbundle *hb = frame_get_headerbundle(fp->cur_frame);
-  headerbundle_append_header(hb, key, val);  // The bundle takes ownership of key and val
+  // Move on past the current line
+  fp->header_pos = lfpos + 1;
 
   return true;
 }
@@ -404,15 +429,56 @@ bool frameparser_parse_body(frameparser *fp, buffer *b)
   }
 }
 
+// Gets space for more of a content-length body, so that it can be read there
+//  directly instead of by way of the input buffer. Once the body fills its
+//  space it doubles in size, up to the content-length, so memory only grows
+//  with the bytes that actually arrive. Returns false if the parser isn't
+//  waiting on the rest of such a body.
+bool frameparser_get_body_space(frameparser *fp, uint8_t **space, size_t *length)
+{
+  if ((fp->state != FP_STATE_BODY) || (fp->length_left <= 0))
+    return false;
+
+  bytestring *body = fp->cur_frame->body;
+  if (body->length == body->size)
+  {
+    size_t size = body->size * 2;
+    if (size > (body->length + fp->length_left))
+      size = body->length + fp->length_left;
+
+    bytestring_resize(body, size);
+  }
+
+  *space  = body->data + body->length;
+  *length = body->size - body->length;
+  if (*length > fp->length_left)
+    *length = fp->length_left;
+
+  return true;
+}
+
+// Records body bytes written to the space from frameparser_get_body_space().
+void frameparser_add_body_bytes(frameparser *fp, size_t count)
+{
+  assert(count <= fp->length_left);
+
+  fp->cur_frame->body->length += count;
+  fp->length_left -= count;
+
+  // If we satisfied the expected length then the frame is complete
+  if (fp->length_left == 0)
+    fp->state = FP_STATE_END;
+}
+
 // Parses trailing NUL character. Returns true iff progress was made.
 bool frameparser_parse_end(frameparser *fp, buffer *b)
 {
   // Valid input in this state is simply a single NUL character
   log_printf(LOG_LEVEL_DEBUG, "frameparser_parse_end\n");
 
-  // If there is already a parsed frame that hasn't been picked up yet, we
-  //  don't want to overwrite it, so refrain from finishing this frame.
-  if (fp->fin_frame)
+  // If the finished frames haven't been picked up yet, there is nowhere to
+  //  put this one, so refrain from finishing it.
+  if (fp->fin_count == FP_FRAME_QUEUE_SIZE)
     return false;  // No progress
 
   // Check for the NUL
@@ -427,7 +493,8 @@ bool frameparser_parse_end(frameparser *fp, buffer *b)
   buffer_consume(b, 1);
 
   // All done with the current frame
-  fp->fin_frame = fp->cur_frame;
+  fp->fin_frames[(fp->fin_head + fp->fin_count) % FP_FRAME_QUEUE_SIZE] = fp->cur_frame;
+  fp->fin_count++;
   fp->cur_frame = NULL;
   fp->state = FP_STATE_IDLE;
 
@@ -474,13 +541,14 @@ frameparser_outcome frameparser_parse(frameparser *fp, buffer *b)
       done = true;
   }
 
-  // Can't make any more parsing progress for now. Might as well compact the buffer.
-  buffer_compact(b);
+  // Can't make any more parsing progress for now. The buffer is left as it
+  //  is, as it reclaims consumed space itself when it needs room.
 
-  if (fp->state == FP_STATE_ERROR)
-    return FP_OUTCOME_ERROR;
-  else if (fp->fin_frame)
+  // Frames finished before any error are still good
+  if (fp->fin_count > 0)
     return FP_OUTCOME_FRAME;
+  else if (fp->state == FP_STATE_ERROR)
+    return FP_OUTCOME_ERROR;
 
   return FP_OUTCOME_WAITING;
 }
@@ -488,13 +556,14 @@ frameparser_outcome frameparser_parse(frameparser *fp, buffer *b)
 void frameparser_free(frameparser *fp)
 {
   if (fp->cur_frame)
-    xfree(fp->cur_frame);
+    frame_free(fp->cur_frame);
 
-  if (fp->fin_frame)
-    xfree(fp->fin_frame);
+  while (fp->fin_count > 0)
+    frame_free(frameparser_get_frame(fp));
 
   if (fp->error)
     bytestring_free(fp->error);
 
+  xfree(fp->header_lines);
   xfree(fp);
 }
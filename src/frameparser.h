@@ -1,5 +1,6 @@
 #include <stdlib.h>  // size_t
 #include <stdint.h>  // uint8_t
+#include <stdbool.h>
 
 #ifndef MINISTOMPD_FRAMEPARSER_H
 #define MINISTOMPD_FRAMEPARSER_H
@@ -23,19 +24,45 @@ typedef enum
 
 #define FP_LENGTH_UNKNOWN (-1)
 
+#define FP_FRAME_QUEUE_SIZE  16            // Finished frames held before parsing stalls
+#define FP_BODY_PREALLOC_MAX (256 * 1024)  // Most body space allocated before any of it arrives
+
+// Position of a header line within the buffered header lines. The lines
+//  stay in the input buffer until the blank line ending them arrives.
+struct fp_header_line
+{
+  int  keypos;   // Offset of the key
+  int  keylen;   // Length of the key
+  int  valpos;   // Offset of the value
+  int  vallen;   // Length of the value
+  bool escaped;  // Contains a backslash, so needs unescaping
+};
+
 typedef struct
 {
-  frameparser_state state;        // Current state
-  int               length_left;  // Count of body bytes left to read to satisfy content-length header
-  frame            *cur_frame;    // Current incomplete frame being parsed
-  frame            *fin_frame;    // A finished frame that has not been picked up yet
-  bytestring       *error;        // Error message, if any
+  frameparser_state      state;         // Current state
+  int                    length_left;   // Count of body bytes left to read to satisfy content-length header
+  int                    scan_pos;      // Buffered bytes already scanned without finding the end of the current line
+  int                    scan_colon;    // Position of the current header line's colon, if scanned already, or -1
+  bool                   scan_backslash;  // A backslash has been scanned in the current header line
+  int                    header_pos;    // Count of buffered bytes taken up by header lines read so far
+  int                    header_count;  // Number of header lines read so far
+  int                    header_size;   // Number of header line positions that fit in allocated memory
+  struct fp_header_line *header_lines;  // Positions of header lines read so far
+  frame                 *cur_frame;     // Current incomplete frame being parsed
+  frame                 *fin_frames[FP_FRAME_QUEUE_SIZE];  // Ring of finished frames that have not been picked up yet
+  int                    fin_head;      // Index of the oldest finished frame
+  int                    fin_count;     // Number of finished frames waiting
+  bytestring            *error;         // Error message, if any
 } frameparser;
 
 frameparser        *frameparser_new(void);
 const bytestring   *frameparser_get_error(frameparser *fp);
 frame              *frameparser_get_frame(frameparser *fp);
+int                 frameparser_get_frames(frameparser *fp, frame **frames, int max);
 frameparser_outcome frameparser_parse(frameparser *fp, buffer *b);
+bool                frameparser_get_body_space(frameparser *fp, uint8_t **space, size_t *length);
+void                frameparser_add_body_bytes(frameparser *fp, size_t count);
 void                frameparser_free(frameparser *fp);
 
 #endif
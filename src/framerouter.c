@@ -4,29 +4,119 @@
 #define FRAMEROUTER_DEFAULT_SUBS_SIZE 8
 #define FRAMEROUTER_DEFAULT_DISP_SIZE 4
 
+// Picks the next subscription in round-robin order, skipping those whose
+//  connections are throttled. Returns NULL if there are none to pick.
 static subscription *framerouter_find_subscription(framerouter *fr)
 {
   int sub_count = list_get_length(fr->subscriptions);
   if (sub_count == 0)
     return NULL;  // No subscriptions
 
-  fr->subscription_index %= sub_count;
+  for (int i = 0; i < sub_count; i++)
+  {
+    fr->subscription_index %= sub_count;
 
-  subscription *sub = list_get_item(fr->subscriptions, fr->subscription_index);
+    subscription *sub = list_get_item(fr->subscriptions, fr->subscription_index);
 
-  fr->subscription_index++;
+    fr->subscription_index++;
 
-  return sub;
+    if (!connection_is_throttled(sub->connection))
+      return sub;
+  }
+
+  return NULL;  // Every subscription is throttled
+}
+
+// Holds a broadcast dispatch back for one subscription, until it can take it.
+static void framerouter_hold(framerouter *fr, subscription *sub, struct dispatch *d)
+{
+  if (!sub->holding)
+  {
+    sub->holding = true;
+    list_push(fr->held, sub);
+  }
+
+  list_push(sub->held, d);
+  d->holds++;
+}
+
+// Lets go of a dispatch held back for a subscription. One forgotten
+//  meanwhile is freed once nothing holds it.
+static void framerouter_unhold(struct dispatch *d)
+{
+  if ((--d->holds == 0) && !d->frame && !d->waiting)
+    xfree(d);
+}
+
+// Takes the next dispatch off the line of those waiting, freeing any that
+//  were forgotten while they waited. Returns NULL if there are none left.
+static struct dispatch *framerouter_next_waiting(framerouter *fr)
+{
+  struct dispatch *d;
+  while ((d = list_shift(fr->waiting)))
+  {
+    d->waiting = false;
+    if (d->frame)
+      return d;
+
+    if (d->holds == 0)
+      xfree(d);
+  }
+
+  return NULL;
 }
 
-framerouter *framerouter_new()
+// Drops everything held back for a subscription. The caller takes the
+//  subscription off the router's list of held subscriptions.
+static void framerouter_drop_held(subscription *sub)
+{
+  int count = list_get_length(sub->held);
+  for (int i = 0; i < count; i++)
+    framerouter_unhold(list_get_item(sub->held, i));
+
+  list_clear(sub->held);
+  sub->holding = false;
+}
+
+// Delivers what was held back for a subscription, in the order it was held,
+//  skipping frames that have left storage meanwhile. The caller takes the
+//  subscription off the router's list of held subscriptions. A delivery the
+//  connection has no room for comes straight back to be held again, and so
+//  does everything after it, to stay in order.
+static void framerouter_release(framerouter *fr, subscription *sub)
+{
+  list *held = sub->held;
+  sub->held    = list_new(list_get_length(held));
+  sub->holding = false;
+
+  int count = list_get_length(held);
+  for (int i = 0; i < count; i++)
+  {
+    struct dispatch *d = list_get_item(held, i);
+    if (d->frame && sub->holding)
+      framerouter_hold(fr, sub, d);
+    else if (d->frame)
+      shard_deliver(sub, d->frame);
+
+    framerouter_unhold(d);
+  }
+
+  list_free(held);
+}
+
+framerouter *framerouter_new(qc_distribution distribution)
 {
   framerouter *fr = xmalloc(sizeof(framerouter));
 
+  fr->distribution = distribution;
+
   fr->subscriptions      = list_new(FRAMEROUTER_DEFAULT_SUBS_SIZE);
   fr->subscription_index = 0;
 
   fr->dispatches = list_new(FRAMEROUTER_DEFAULT_DISP_SIZE);
+  fr->waiting    = list_new(FRAMEROUTER_DEFAULT_DISP_SIZE);
+  fr->held       = list_new(FRAMEROUTER_DEFAULT_SUBS_SIZE);
+  fr->pumping    = false;
 
   return fr;
 }
@@ -36,8 +126,28 @@ void framerouter_free(framerouter *fr)
   // Note: We do not free the individual subscriptions because we do not own them
   list_free(fr->subscriptions);
 
-  // TODO: Free the contained dispatches
+  // Let go of held dispatches first, which frees those already forgotten
+  subscription *sub;
+  while ((sub = list_pop(fr->held)))
+    framerouter_drop_held(sub);
+  list_free(fr->held);
+
+  // Waiting dispatches are also on the list of all dispatches, unless they
+  //  have been forgotten
+  struct dispatch *d;
+  while ((d = list_pop(fr->waiting)))
+  {
+    if (!d->frame)
+      xfree(d);
+  }
+
+  while ((d = list_pop(fr->dispatches)))
+  {
+    frame_free(d->frame);
+    xfree(d);
+  }
   list_free(fr->dispatches);
+  list_free(fr->waiting);
 
   xfree(fr);
 }
@@ -47,6 +157,9 @@ void framerouter_free(framerouter *fr)
 void framerouter_add_subscription(framerouter *fr, subscription *sub)
 {
   list_push(fr->subscriptions, sub);
+
+  // Frames may have been waiting for a subscriber
+  framerouter_pump(fr);
 }
 
 // Removes a subscription from the framerouter. Returns true iff subscription
@@ -58,6 +171,14 @@ bool framerouter_remove_subscription(framerouter *fr, subscription *sub)
     return false;  // Not found
 
   list_remove(fr->subscriptions, i);
+
+  // Forget anything held back for it
+  if (sub->holding)
+  {
+    list_remove(fr->held, list_search(fr->held, sub));
+    framerouter_drop_held(sub);
+  }
+
   return true;
 }
 
@@ -66,18 +187,197 @@ int framerouter_subscription_count(framerouter *fr)
   return list_get_length(fr->subscriptions);
 }
 
+// Routes a stored frame to the router's subscriptions. The dispatch takes a
+//  reference to the frame, which it holds until the frame is forgotten.
 void framerouter_dispatch(framerouter *fr, frame *f, storage_handle sh)
 {
   struct dispatch *d = xmalloc(sizeof(struct dispatch));
-  d->frame  = f;
+  d->frame  = frame_ref(f);
   d->handle = sh;
-  if (clock_gettime(CLOCK_MONOTONIC, &d->createtime))
-    abort();  // Couldn't get time
+  d->createtime = loopclock_now();
+  d->holds  = 0;
+  d->waiting = true;
+
+  // Deliveries read the message-id as it is stored, since by then the frame
+  //  is shared between shards, so unescape it now while only this shard
+  //  sees the frame
+  headerbundle_get_header_value_by_atom(frame_get_headerbundle(f), HDR_MESSAGE_ID);
 
   list_push(fr->dispatches, d);
+  list_push(fr->waiting, d);
+
+  framerouter_pump(fr);
+}
+
+// Finds the dispatch for the given frame. Returns its index in the list of
+//  dispatches, or -1 if the frame isn't one of this router's.
+static int framerouter_find_dispatch(framerouter *fr, frame *f)
+{
+  int count = list_get_length(fr->dispatches);
+  for (int i = 0; i < count; i++)
+  {
+    if (((struct dispatch *) list_get_item(fr->dispatches, i))->frame == f)
+      return i;
+  }
+
+  return -1;
+}
+
+// Takes back a frame a subscription gave up on, because its connection had
+//  no room for it or its client didn't acknowledge it in time, along with
+//  the caller's reference to it. On a broadcast queue every other
+//  subscription already has the frame, so it is retried on that
+//  subscription alone. Otherwise it goes back at the head of the line for
+//  any subscription, ahead of newer frames. Either way it waits until there
+//  is somewhere to put it, rather than being dropped. Returns false if there
+//  is nothing left to retry, as happens once the frame has expired.
+bool framerouter_redispatch(framerouter *fr, subscription *sub, frame *f)
+{
+  int i = framerouter_find_dispatch(fr, f);
+  if (i < 0)
+  {
+    frame_free(f);
+    return false;  // Expired while in transit
+  }
+
+  frame_free(f);  // The dispatch holds its own reference
+
+  if (fr->distribution == QC_DIST_BROADCAST)
+  {
+    // The subscription may have gone away while the frame was in transit
+    if (list_search(fr->subscriptions, sub) < 0)
+      return false;  // Nobody left to retry on
+
+    framerouter_hold(fr, sub, list_get_item(fr->dispatches, i));
+  }
+  else
+  {
+    struct dispatch *d = list_get_item(fr->dispatches, i);
+    d->waiting = true;
+    list_unshift(fr->waiting, d);
+  }
+
+  framerouter_pump(fr);
+  return true;
+}
+
+// Drops every trace of frames from the router. Called when frames leave
+//  storage, which gives them oldest first; dispatches are made in store
+//  order, so theirs are at the head of the list. Deliveries and serializers
+//  holding a frame keep their own references, and anything they hand back
+//  afterwards is ignored. A dispatch still waiting in line, or held back for
+//  subscriptions, is only marked as forgotten, and skipped when its turn
+//  comes, rather than searched for.
+void framerouter_forget(framerouter *fr, frame **frames, int count)
+{
+  int forgotten = 0;
+  int length = list_get_length(fr->dispatches);
+  for (int i = 0; (i < count) && (forgotten < length); i++)
+  {
+    struct dispatch *d = list_get_item(fr->dispatches, forgotten);
+    if (d->frame != frames[i])
+      continue;  // Not one of ours
+
+    forgotten++;
+
+    frame_free(d->frame);
+    d->frame = NULL;
+
+    if ((d->holds == 0) && !d->waiting)
+      xfree(d);
+  }
+
+  list_remove_range(fr->dispatches, 0, forgotten);
+}
+
+// Delivers what was held back for subscriptions whose connections have
+//  drained since.
+static void framerouter_release_held(framerouter *fr)
+{
+  for (int i = list_get_length(fr->held) - 1; i >= 0; i--)
+  {
+    subscription *sub = list_get_item(fr->held, i);
+    if (connection_is_throttled(sub->connection))
+      continue;  // Still full
+
+    list_remove(fr->held, i);
+    framerouter_release(fr, sub);
+  }
+}
+
+// Delivers each waiting dispatch to every subscription. The frame is
+//  serialized once up front, so each delivery only adds its own headers.
+//  Subscriptions whose connections are throttled have their share held
+//  back, without holding up the rest, and get it in order once they drain.
+static void framerouter_pump_broadcast(framerouter *fr)
+{
+  framerouter_release_held(fr);
+
+  int sub_count = list_get_length(fr->subscriptions);
+  if ((sub_count == 0) || (list_get_length(fr->waiting) == 0))
+    return;  // Nobody to deliver to, or nothing to deliver
+
+  // Look at each connection's throttle once for the whole run of frames.
+  //  Subscriptions with earlier frames held back keep holding, to stay in
+  //  order.
+  for (int i = 0; i < sub_count; i++)
+  {
+    subscription *sub = list_get_item(fr->subscriptions, i);
+    if (!sub->holding && connection_is_throttled(sub->connection))
+    {
+      sub->holding = true;
+      list_push(fr->held, sub);
+    }
+  }
+
+  struct dispatch *d;
+  while ((d = framerouter_next_waiting(fr)))
+  {
+    frame *f = d->frame;
+
+    if (!f->wire)
+      f->wire = wireimage_new(f);
+
+    for (int i = 0; i < sub_count; i++)
+    {
+      subscription *sub = list_get_item(fr->subscriptions, i);
+      if (sub->holding)
+        framerouter_hold(fr, sub, d);
+      else
+        shard_deliver(sub, f);
+    }
+  }
+}
+
+// Delivers waiting dispatches, in order, for as long as there are
+//  subscriptions able to take them.
+void framerouter_pump(framerouter *fr)
+{
+  // A delivery on this shard that finds its connection full is handed
+  //  straight back, which pumps again; the pump already running carries on
+  //  instead, so that frames stay in order
+  if (fr->pumping)
+    return;
+
+  fr->pumping = true;
+
+  if (fr->distribution == QC_DIST_BROADCAST)
+    framerouter_pump_broadcast(fr);
+  else
+  {
+    while (list_get_length(fr->waiting) > 0)
+    {
+      subscription *sub = framerouter_find_subscription(fr);
+      if (sub == NULL)
+        break;  // Nobody to deliver to; wait to be pumped again
+
+      struct dispatch *d = framerouter_next_waiting(fr);
+      if (d == NULL)
+        break;  // Only forgotten ones were left
 
-  subscription *sub = framerouter_find_subscription(fr);
-  assert(sub != NULL);
+      shard_deliver(sub, d->frame);
+    }
+  }
 
-  subscription_deliver(sub, f);
+  fr->pumping = false;
 }
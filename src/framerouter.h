@@ -3,11 +3,14 @@
 #ifndef MINISTOMPD_FRAMEROUTER_H
 #define MINISTOMPD_FRAMEROUTER_H
 
-framerouter *framerouter_new();
+framerouter *framerouter_new(qc_distribution distribution);
 void framerouter_free(framerouter *fr);
 void framerouter_add_subscription(framerouter *fr, subscription *sub);
 bool framerouter_remove_subscription(framerouter *fr, subscription *sub);
 int  framerouter_subscription_count(framerouter *fr);
 void framerouter_dispatch(framerouter *fr, frame *f, storage_handle sh);
+void framerouter_pump(framerouter *fr);
+bool framerouter_redispatch(framerouter *fr, subscription *sub, frame *f);
+void framerouter_forget(framerouter *fr, frame **frames, int count);
 
 #endif
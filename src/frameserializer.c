@@ -1,4 +1,6 @@
-#include <string.h>  // strlen()
+#include <string.h>  // strlen(), memcpy()
+#include <sys/uio.h>  // writev()
+#include <sys/socket.h>  // sendmsg(), MSG_MORE
 #include "ministompd.h"
 
 // Returns the number of bytes the given string would take up after escaping
@@ -8,59 +10,220 @@
 static size_t header_bytestring_escaped_length(const bytestring *bs)
 {
   size_t hlen = bytestring_get_length(bs);
-  size_t elen = 0;
-
   const uint8_t *bytes = bytestring_get_bytes(bs);
-  for (int i = 0; i < hlen; i++)
+
+  // Each octet needing escaping takes up one extra byte
+  size_t elen = hlen;
+  size_t i = bytescan_find_escapable(bytes, hlen);
+  while (i < hlen)
   {
-    switch (bytes[i])
-    {
-    case 0x0A:
-    case 0x0D:
-    case 0x3A:
-    case 0x5C:
-      elen++;
-    }
     elen++;
+    i++;
+    i += bytescan_find_escapable(bytes + i, hlen - i);
   }
 
   return elen;
 }
 
-// Performs header octet escaping on the 'in' bytestring, appending the result
-//  to the 'out' bytestring.
-static void escape_header_bytestring(bytestring *out, const bytestring *in)
+// Writes the header octet escaped form of the 'in' bytestring to 'out', which
+//  must have room for header_bytestring_escaped_length() bytes, or twice the
+//  input length at worst. Runs of octets between those needing escaping are
+//  found by the vectorized scan and copied whole, so input with nothing to
+//  escape is one scan and one copy. Returns a pointer just past the last byte
+//  written.
+static uint8_t *escape_header_bytes(uint8_t *out, const bytestring *in)
 {
   size_t ilen = bytestring_get_length(in);
-
   const uint8_t *bytes = bytestring_get_bytes(in);
-  for (int i = 0; i < ilen; i++)
+
+  size_t i = 0;
+  while (i < ilen)
   {
+    // Copy the run of octets up to the next one needing escaping
+    size_t run = bytescan_find_escapable(bytes + i, ilen - i);
+    memcpy(out, bytes + i, run);
+    out += run;
+
+    i += run;
+    if (i == ilen)
+      break;
+
+    *out++ = '\\';
     switch (bytes[i])
     {
     case 0x0A:  // LF
-      bytestring_append_byte(out, '\\');
-      bytestring_append_byte(out, 'n');
+      *out++ = 'n';
       break;
     case 0x0D:  // CR
-      bytestring_append_byte(out, '\\');
-      bytestring_append_byte(out, 'r');
+      *out++ = 'r';
       break;
     case 0x3A:  // Colon
-      bytestring_append_byte(out, '\\');
-      bytestring_append_byte(out, 'c');
+      *out++ = 'c';
       break;
     case 0x5C:  // Backslash
-      bytestring_append_byte(out, '\\');
-      bytestring_append_byte(out, '\\');
-      break;
-    default:
-      bytestring_append_byte(out, bytes[i]);
+      *out++ = '\\';
       break;
     }
+    i++;
   }
 
-  return;
+  return out;
+}
+
+// Writes a header key or value to 'out' in wire form: escaped, unless it
+//  still is from when it arrived. Returns a pointer just past the last byte
+//  written.
+static uint8_t *write_header_part(uint8_t *out, const bytestring *in, bool escaped)
+{
+  if (!escaped)
+    return escape_header_bytes(out, in);
+
+  size_t len = bytestring_get_length(in);
+  memcpy(out, bytestring_get_bytes(in), len);
+  return out + len;
+}
+
+// Serializes a frame ahead of delivery to many subscribers. The caller holds
+//  the only reference to the result.
+wireimage *wireimage_new(frame *f)
+{
+  const char *name = frame_command_name(f->command);
+  size_t command_length = strlen(name) + 1;
+  headerbundle *hb = frame_get_headerbundle(f);
+  size_t bodylen = f->body ? bytestring_get_length(f->body) : 0;
+
+  // Work out the size first, so the image takes a single allocation
+  size_t length = command_length;
+  for (int i = 0; i < hb->count; i++)
+  {
+    const bytestring *key;
+    const bytestring *val;
+    int escaped;
+    headerbundle_get_raw_header(hb, i, &key, &val, &escaped);
+
+    length += (escaped & HEADER_ESCAPED_KEY) ? bytestring_get_length(key) : header_bytestring_escaped_length(key);
+    length += (escaped & HEADER_ESCAPED_VAL) ? bytestring_get_length(val) : header_bytestring_escaped_length(val);
+    length += 2;  // Colon and LF
+  }
+  length += 1 + bodylen;  // Blank line and body
+
+  wireimage *w = xmalloc(sizeof(wireimage) + length);
+  w->refcount       = 1;
+  w->command_length = command_length;
+  w->length         = length;
+  w->data           = (uint8_t *) (w + 1);
+
+  uint8_t *p = w->data;
+  memcpy(p, name, command_length - 1);
+  p += command_length - 1;
+  *p++ = '\n';
+
+  for (int i = 0; i < hb->count; i++)
+  {
+    const bytestring *key;
+    const bytestring *val;
+    int escaped;
+    headerbundle_get_raw_header(hb, i, &key, &val, &escaped);
+
+    p = write_header_part(p, key, escaped & HEADER_ESCAPED_KEY);
+    *p++ = ':';
+    p = write_header_part(p, val, escaped & HEADER_ESCAPED_VAL);
+    *p++ = '\n';
+  }
+  *p++ = '\n';
+
+  if (bodylen > 0)
+    memcpy(p, bytestring_get_bytes(f->body), bodylen);
+
+  return w;
+}
+
+void wireimage_ref(wireimage *w)
+{
+  __atomic_add_fetch(&w->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void wireimage_unref(wireimage *w)
+{
+  if (__atomic_sub_fetch(&w->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    xfree(w);
+}
+
+// Drops what a work item holds on top of its frame.
+static void frameserializer_release_item(fs_work_item *item)
+{
+  if (item->wire)
+    wireimage_unref(item->wire);
+  if (item->overlay)
+    headerbundle_free(item->overlay);
+}
+
+// Finds the bytes to send after the headers: the frame's body, or the rest
+//  of its wire image. Either way the trailing NUL is sent separately.
+static const uint8_t *frameserializer_item_body(const fs_work_item *item, size_t *length)
+{
+  if (item->wire)
+  {
+    *length = item->wire->length - item->wire->command_length;
+    return item->wire->data + item->wire->command_length;
+  }
+
+  const bytestring *body = item->frame->body;
+  *length = body ? bytestring_get_length(body) : 0;
+  return body ? bytestring_get_bytes(body) : NULL;
+}
+
+// Returns the work item the given number of places from the head of the
+//  work queue.
+static inline fs_work_item *frameserializer_work_item(frameserializer *fs, int i)
+{
+  return &fs->work_queue[(fs->work_queue_head + i) & (fs->work_queue_size - 1)];
+}
+
+// Moves the items of a full ring into a new array with twice the slots,
+//  starting from its first slot. Returns the new array.
+static void *frameserializer_grow_ring(void *ring, int size, int head, size_t itemsize)
+{
+  uint8_t *old = ring;
+  uint8_t *new = xmalloc(itemsize * size * 2);
+
+  size_t tail = itemsize * (size - head);  // Bytes from the head to the end of the old array
+  memcpy(new, old + (itemsize * head), tail);
+  memcpy(new + tail, old, itemsize * head);
+
+  xfree(old);
+  return new;
+}
+
+// Ensures there is a free slot at the tail of the work queue, growing it if
+//  it is full and still below the cap. Returns false if there is no room.
+static bool frameserializer_work_queue_room(frameserializer *fs)
+{
+  if (fs->work_queue_length >= fs->queue_max)
+    return false;  // At the cap
+  else if (fs->work_queue_length < fs->work_queue_size)
+    return true;
+
+  fs->work_queue      = frameserializer_grow_ring(fs->work_queue, fs->work_queue_size, fs->work_queue_head, sizeof(fs_work_item));
+  fs->work_queue_size *= 2;
+  fs->work_queue_head = 0;
+
+  return true;
+}
+
+// Likewise, for the completed queue.
+static bool frameserializer_completed_queue_room(frameserializer *fs)
+{
+  if (fs->completed_queue_length >= fs->queue_max)
+    return false;  // At the cap
+  else if (fs->completed_queue_length < fs->completed_queue_size)
+    return true;
+
+  fs->completed_queue      = frameserializer_grow_ring(fs->completed_queue, fs->completed_queue_size, fs->completed_queue_head, sizeof(fs_completed_item));
+  fs->completed_queue_size *= 2;
+  fs->completed_queue_head = 0;
+
+  return true;
 }
 
 frameserializer *frameserializer_new(void)
@@ -69,10 +232,14 @@ frameserializer *frameserializer_new(void)
 
   fs->state                  = FS_STATE_IDLE;
   fs->nextqid                = 1;
+  fs->body_ref_min           = FS_BODY_REF_MIN;
+  fs->queue_max              = FS_QUEUE_MAX;
   fs->work_queue_size        = FS_QUEUE_SIZE;
+  fs->work_queue_head        = 0;
   fs->work_queue_length      = 0;
   fs->work_queue             = xmalloc(sizeof(fs_work_item) * fs->work_queue_size);
   fs->completed_queue_size   = FS_QUEUE_SIZE;
+  fs->completed_queue_head   = 0;
   fs->completed_queue_length = 0;
   fs->completed_queue        = xmalloc(sizeof(fs_completed_item) * fs->completed_queue_size);
 
@@ -81,27 +248,45 @@ frameserializer *frameserializer_new(void)
 
 void frameserializer_free(frameserializer *fs)
 {
-  // TODO: Free any constituent frames
+  for (int i = 0; i < fs->work_queue_length; i++)
+  {
+    fs_work_item *item = frameserializer_work_item(fs, i);
+    frameserializer_release_item(item);
+    frame_free(item->frame);
+  }
+
+  fs_completed_item item;
+  while (frameserializer_get_completed_frame(fs, &item))
+    frame_free(item.frame);
+
   xfree(fs->work_queue);
   xfree(fs->completed_queue);
   xfree(fs);
 }
 
-// Adds the given frame to the work queue. The frameserializer takes ownership
-//  of the frame. Returns the qid, or zero if the frame could not be queued.
-int frameserializer_enqueue_frame(frameserializer *fs, frame *f)
+// Adds the given frame to the work queue, with an overlay of headers for this
+//  delivery alone, which may be NULL. The overlay goes out ahead of the
+//  frame's own headers, so it wins over any of them with the same name. The
+//  frame is only ever read, so one shared between many deliveries is never
+//  copied or changed, and comes back through the completed queue. Once
+//  queued, takes a reference to the frame and ownership of the overlay.
+//  Returns the qid, or zero if the work queue is at its cap.
+int frameserializer_enqueue_frame(frameserializer *fs, frame *f, headerbundle *overlay)
 {
   // Bounds check
-  if (fs->work_queue_length >= fs->work_queue_size)
+  if (!frameserializer_work_queue_room(fs))
     return 0;  // No room in work queue
 
   // Fill in new item
-  fs_work_item *item = &fs->work_queue[fs->work_queue_length];
-  item->frame        = f;
+  fs_work_item *item = frameserializer_work_item(fs, fs->work_queue_length);
+  item->frame        = frame_ref(f);
   item->qid          = fs->nextqid;
   item->state        = FS_WORK_STATE_COMMAND;
   item->header_index = 0;
   item->body_index   = 0;
+  item->body_ref     = false;
+  item->wire         = NULL;
+  item->overlay      = overlay;
 
   // Housekeeping
   fs->work_queue_length++;
@@ -110,6 +295,73 @@ int frameserializer_enqueue_frame(frameserializer *fs, frame *f)
   return item->qid;
 }
 
+// Adds a frame to the work queue to be sent from its wire image, with the
+//  given overlay headers ahead of the image's. Once queued, takes a reference
+//  to the wire image, and ownership of the overlay, which may be NULL.
+//  Returns the qid, or zero if the work queue is at its cap.
+int frameserializer_enqueue_wireimage(frameserializer *fs, frame *f, wireimage *w, headerbundle *overlay)
+{
+  int qid = frameserializer_enqueue_frame(fs, f, overlay);
+  if (qid == 0)
+    return 0;
+
+  fs_work_item *item = frameserializer_work_item(fs, fs->work_queue_length - 1);
+  wireimage_ref(w);
+  item->wire = w;
+
+  return qid;
+}
+
+// Returns true iff there are frames waiting to be serialized.
+bool frameserializer_has_work_frames(frameserializer *fs)
+{
+  return (fs->work_queue_length > 0);
+}
+
+// Returns the number of frames waiting to be serialized.
+int frameserializer_get_work_frame_count(frameserializer *fs)
+{
+  return fs->work_queue_length;
+}
+
+// Returns true iff the work queue is at its cap, so no more frames can be
+//  enqueued until some have been sent.
+bool frameserializer_is_full(frameserializer *fs)
+{
+  return (fs->work_queue_length >= fs->queue_max);
+}
+
+// Removes the head item from the completed queue, copying it into 'item'.
+//  The caller takes over the serializer's reference to the frame, and must
+//  drop it with frame_free(). Returns false if the completed queue is empty.
+bool frameserializer_get_completed_frame(frameserializer *fs, fs_completed_item *item)
+{
+  if (fs->completed_queue_length < 1)
+    return false;
+
+  *item = fs->completed_queue[fs->completed_queue_head];
+
+  fs->completed_queue_head = (fs->completed_queue_head + 1) & (fs->completed_queue_size - 1);
+  fs->completed_queue_length--;
+
+  return true;
+}
+
+// Sets the minimum body length that is written straight from the frame by
+//  frameserializer_output_fd(), rather than copied into the buffer. Zero
+//  means bodies are always copied, for callers that only drain the buffer.
+void frameserializer_set_body_ref_min(frameserializer *fs, size_t min)
+{
+  fs->body_ref_min = min;
+}
+
+// Sets the most frames that may wait to be serialized. Frames already queued
+//  beyond a lowered cap are still sent.
+void frameserializer_set_queue_max(frameserializer *fs, int max)
+{
+  fs->queue_max = (max > 0) ? max : 1;
+}
+
 // Moves the head frame from the work queue to the tail of the completed
 //  queue, and marks it with the given state. Returns the qid, or zero if no
 //  frame was moved.
@@ -117,22 +369,23 @@ static int frameserializer_complete_frame(frameserializer *fs, fs_completed_item
 {
   if (fs->work_queue_length < 1)
     return 0;  // No frame at the head of the work queue
-  else if (fs->completed_queue_length >= fs->completed_queue_size)
+  else if (!frameserializer_completed_queue_room(fs))
     return 0;  // No room in completed queue
 
   // Get head work item
-  fs_work_item *witem = &fs->work_queue[0];
+  fs_work_item *witem = frameserializer_work_item(fs, 0);
 
   // Add new tail completed item
-  fs_completed_item *citem = &fs->completed_queue[fs->completed_queue_length];
+  fs_completed_item *citem = &fs->completed_queue[(fs->completed_queue_head + fs->completed_queue_length) & (fs->completed_queue_size - 1)];
   citem->frame = witem->frame;
   citem->qid   = witem->qid;
   citem->state = state;
   fs->completed_queue_length++;
 
   // Remove old work item
+  frameserializer_release_item(witem);
+  fs->work_queue_head = (fs->work_queue_head + 1) & (fs->work_queue_size - 1);
   fs->work_queue_length--;
-  memmove(fs->work_queue, fs->work_queue + 1, sizeof(fs->work_queue[0]) * fs->work_queue_length);
 
   return citem->qid;
 }
@@ -140,15 +393,25 @@ static int frameserializer_complete_frame(frameserializer *fs, fs_completed_item
 // Serializes a frame command. Returns true iff progress was made.
 static bool frameserializer_serialize_command(frameserializer *fs, buffer *b)
 {
-  fs_work_item *item = &fs->work_queue[0];
+  fs_work_item *item = frameserializer_work_item(fs, 0);
+
+  // A wire image has the command line ready to go
+  if (item->wire)
+  {
+    if (buffer_write_bytes(b, item->wire->data, item->wire->command_length) != item->wire->command_length)
+      abort();  // Short write
+
+    item->state = FS_WORK_STATE_HEADERS;
+    return true;
+  }
 
   const char *name = frame_command_name(item->frame->command);
   size_t namelen = strlen(name);
 
-  if (buffer_input_bytes(b, (const uint8_t *) name, namelen) != namelen)
+  if (buffer_write_bytes(b, (const uint8_t *) name, namelen) != namelen)
     abort();  // Short write
 
-  if (buffer_input_byte(b, '\n') != 1)
+  if (buffer_write_byte(b, '\n') != 1)
     abort();  // Short write
 
   item->state = FS_WORK_STATE_HEADERS;
@@ -159,64 +422,58 @@ static bool frameserializer_serialize_command(frameserializer *fs, buffer *b)
 // Serializes a frame header. Returns true iff progress was made.
 static bool frameserializer_serialize_header(frameserializer *fs, buffer *b)
 {
-  fs_work_item *item = &fs->work_queue[0];
+  fs_work_item *item = frameserializer_work_item(fs, 0);
 
-  headerbundle *hb = frame_get_headerbundle(item->frame);
+  // The overlay goes first, then the frame's own headers, unless the wire
+  //  image already holds those
+  headerbundle *own = item->wire ? NULL : frame_get_headerbundle(item->frame);
+  int overlay_count = item->overlay ? item->overlay->count : 0;
+  int count = overlay_count + (own ? own->count : 0);
 
   // All headers done? Add terminating newline
-  if (item->header_index >= hb->count)
+  if (item->header_index >= count)
   {
-    // Add extra linefeed to terminate headers
-    if (buffer_input_byte(b, '\n') != 1)
+    // Add extra linefeed to terminate headers, unless the wire image has it
+    if (!item->wire && (buffer_write_byte(b, '\n') != 1))
       abort();  // Short write
 
+    // Decide how the body will go out
+    size_t bodylen;
+    frameserializer_item_body(item, &bodylen);
+    item->body_ref = (fs->body_ref_min > 0) && (bodylen >= fs->body_ref_min);
+
     item->state = FS_WORK_STATE_BODY;
     return true;
   }
 
-  // Get header data
-  const bytestring *key;
-  const bytestring *val;
-  if (!headerbundle_get_header(hb, item->header_index, &key, &val))
-    abort();  // Should never happen
-
-  // Find header data escaped lengths
-  size_t ekeylen = header_bytestring_escaped_length(key);
-  size_t evallen = header_bytestring_escaped_length(val);
-
-  // TODO: Ensure buffer space before allocating memory
-
-  // Escape header key, if needed
-  bytestring *ekey = NULL;
-  if (ekeylen != bytestring_get_length(key))
+  // Find the next header, in the overlay or else the frame
+  headerbundle *hb = item->overlay;
+  int index = item->header_index;
+  if (index >= overlay_count)
   {
-    ekey = bytestring_new(ekeylen);
-    escape_header_bytestring(ekey, key);
+    hb = own;
+    index -= overlay_count;
   }
 
-  // Escape header value, if needed
-  bytestring *eval = NULL;
-  if (evallen != bytestring_get_length(val))
-  {
-    eval = bytestring_new(evallen);
-    escape_header_bytestring(eval, val);
-  }
+  // Get header data. Anything still escaped as it arrived can go out as it is.
+  const bytestring *key;
+  const bytestring *val;
+  int escaped;
+  if (!headerbundle_get_raw_header(hb, index, &key, &val, &escaped))
+    abort();  // Should never happen
 
-  // Write header data to the buffer
-  if (buffer_input_bytestring(b, ekey ? ekey : key) != ekeylen)
-    abort();  // Short write
-  if (buffer_input_byte(b, ':') != 1)
-    abort();  // Short write
-  if (buffer_input_bytestring(b, eval ? eval : val) != evallen)
-    abort();  // Short write
-  if (buffer_input_byte(b, '\n') != 1)
-    abort();  // Short write
+  // Reserve room for the worst case, where every octet needs escaping, and
+  //  escape straight into the buffer in one pass
+  size_t keylen = bytestring_get_length(key);
+  size_t vallen = bytestring_get_length(val);
+  size_t maxlen = ((escaped & HEADER_ESCAPED_KEY) ? keylen : (keylen * 2)) + ((escaped & HEADER_ESCAPED_VAL) ? vallen : (vallen * 2)) + 2;
 
-  // Clean up escaped headers, if any
-  if (ekey)
-    bytestring_free(ekey);
-  if (eval)
-    bytestring_free(eval);
+  uint8_t *start = buffer_get_write_space(b, maxlen);
+  uint8_t *p = write_header_part(start, key, escaped & HEADER_ESCAPED_KEY);
+  *p++ = ':';
+  p = write_header_part(p, val, escaped & HEADER_ESCAPED_VAL);
+  *p++ = '\n';
+  buffer_add_written_bytes(b, p - start);
 
   // All done with this header
   item->header_index++;
@@ -227,25 +484,30 @@ static bool frameserializer_serialize_header(frameserializer *fs, buffer *b)
 // Serializes a frame body. Returns true iff progress was made.
 static bool frameserializer_serialize_body(frameserializer *fs, buffer *b)
 {
-  fs_work_item *item = &fs->work_queue[0];
-  const bytestring *body = item->frame->body;
+  fs_work_item *item = frameserializer_work_item(fs, 0);
+
+  // Bodies sent by reference are left to frameserializer_output_fd(). Nothing
+  //  else can be serialized until this one is out.
+  if (item->body_ref)
+    return false;
 
   int writecount = 0;
 
   // If we haven't sent the entire body yet, push out as many bytes as possible
-  size_t bodylen = body ? bytestring_get_length(body) : 0;
+  size_t bodylen;
+  const uint8_t *body = frameserializer_item_body(item, &bodylen);
   if (item->body_index < bodylen)
   {
-    int count = buffer_input_bytestring_slice(b, body, item->body_index, bodylen - item->body_index);
+    int count = buffer_write_bytes(b, body + item->body_index, bodylen - item->body_index);
     item->body_index += count;
     writecount += count;
   }
 
   // If the body is done, and there's at least one slot in the completed
   //  queue, send terminating NUL byte and move the frame to that queue.
-  if ((item->body_index >= bodylen) && (fs->completed_queue_length < fs->completed_queue_size))
+  if ((item->body_index >= bodylen) && frameserializer_completed_queue_room(fs))
   {
-    if (buffer_input_byte(b, '\x00') != 1)
+    if (buffer_write_byte(b, '\x00') != 1)
       abort();  // Short write
 
     frameserializer_complete_frame(fs, FS_COMPLETED_STATE_SUCCESS);
@@ -258,7 +520,7 @@ static bool frameserializer_serialize_body(frameserializer *fs, buffer *b)
 // Serializes next step of a frame. Returns true iff progress was made.
 static bool frameserializer_serialize_internal(frameserializer *fs, buffer *b)
 {
-  switch (fs->work_queue[0].state)
+  switch (frameserializer_work_item(fs, 0)->state)
   {
   case FS_WORK_STATE_COMMAND:
     return frameserializer_serialize_command(fs, b);
@@ -287,3 +549,86 @@ void frameserializer_serialize(frameserializer *fs, buffer *b)
 
   return;
 }
+
+// Writes pending output to the given fd with a single writev(): first the
+//  contents of the buffer, then the unsent part of the head frame's body (or
+//  wire image) if that is being sent by reference. Progress through the body is tracked in
+//  the work item, so a short write picks up where it left off. If 'more' is
+//  set, the fd must be a socket, and the kernel is told more output follows
+//  shortly, so that it holds back a partly filled last segment.
+// Return value is the number of bytes written, or -1 on error.
+ssize_t frameserializer_output_fd(frameserializer *fs, buffer *b, int fd, bool more)
+{
+  static const uint8_t nul = '\x00';
+
+  struct iovec iov[3];
+  int iovcnt = 0;
+
+  // Serialized bytes go first
+  size_t buflen = buffer_get_length(b);
+  if (buflen > 0)
+  {
+    iov[iovcnt].iov_base = b->data + b->position;
+    iov[iovcnt].iov_len  = buflen;
+    iovcnt++;
+  }
+
+  // Then the body of the head frame, if it is being sent by reference
+  fs_work_item *item = (fs->work_queue_length > 0) ? frameserializer_work_item(fs, 0) : NULL;
+  size_t bodylen = 0;
+  if (item && ((item->state != FS_WORK_STATE_BODY) || !item->body_ref))
+    item = NULL;
+
+  if (item)
+  {
+    const uint8_t *body = frameserializer_item_body(item, &bodylen);
+
+    if (item->body_index < bodylen)
+    {
+      iov[iovcnt].iov_base = (void *) (body + item->body_index);
+      iov[iovcnt].iov_len  = bodylen - item->body_index;
+      iovcnt++;
+    }
+
+    // The terminating NUL byte completes the frame, so it can only be sent
+    //  once there is a slot for the frame in the completed queue
+    if (frameserializer_completed_queue_room(fs))
+    {
+      iov[iovcnt].iov_base = (void *) &nul;
+      iov[iovcnt].iov_len  = 1;
+      iovcnt++;
+    }
+  }
+
+  // Don't bother if there's nothing to send
+  if (iovcnt == 0)
+    return 0;
+
+  ssize_t ret;
+  if (more)
+  {
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    ret = sendmsg(fd, &msg, MSG_MORE);
+  }
+  else
+    ret = writev(fd, iov, iovcnt);
+  if (ret <= 0)
+    return ret;
+
+  // Consume buffered bytes first, then account for the body
+  size_t remaining = ret;
+  size_t consumed = (remaining < buflen) ? remaining : buflen;
+  buffer_consume(b, consumed);
+  remaining -= consumed;
+
+  if (item && (remaining > 0))
+  {
+    item->body_index += remaining;
+
+    // Past the end of the body means the NUL byte went out too
+    if (item->body_index > bodylen)
+      frameserializer_complete_frame(fs, FS_COMPLETED_STATE_SUCCESS);
+  }
+
+  return ret;
+}
@@ -1,6 +1,20 @@
+#include <sys/types.h>  // ssize_t
+
 #ifndef MINISTOMPD_SERIALIZER_H
 #define MINISTOMPD_SERIALIZER_H
 
+// A frame serialized once, to be sent as it is to many subscribers. Holds
+//  the command line, headers, blank line and body, but not the trailing NUL.
+//  A delivery's overlay headers go between the command line and the rest.
+//  Refcounted, as it is shared between connections on different shards.
+typedef struct wireimage
+{
+  int      refcount;        // References held by frames and work items
+  size_t   command_length;  // Length of the command line, including its LF
+  size_t   length;          // Count of bytes
+  uint8_t *data;            // Serialized bytes, in the same allocation
+} wireimage;
+
 typedef enum
 {
   FS_WORK_STATE_COMMAND,
@@ -10,11 +24,14 @@ typedef enum
 
 typedef struct
 {
-  frame             *frame;         // Frame to be serialized
+  frame             *frame;         // Frame to be serialized, referenced by the item
   int                qid;           // Queue id for this item
   fs_work_item_state state;         // State of this work item
   int                header_index;  // Next header to send
   int                body_index;    // Next body byte to send
+  bool               body_ref;      // Body is written from the frame rather than copied into the buffer
+  wireimage         *wire;          // Serialized form to send instead of the frame's own parts, or NULL
+  headerbundle      *overlay;       // Headers for this delivery alone, sent ahead of the frame's own, or NULL
 } fs_work_item;
 
 typedef enum
@@ -25,12 +42,15 @@ typedef enum
 
 typedef struct
 {
-  frame                  *frame;  // Frame
+  frame                  *frame;  // Frame, with the reference its work item held
   int                     qid;    // Queue id for this item
   fs_completed_item_state state;  // State of this completed item
 } fs_completed_item;
 
-#define FS_QUEUE_SIZE 16
+#define FS_QUEUE_SIZE     16    // Initial slots in each queue; they grow as needed
+#define FS_QUEUE_MAX      1024  // Default cap on frames waiting to be serialized
+
+#define FS_BODY_REF_MIN 16384  // Bodies at least this long are written by reference
 
 typedef enum
 {
@@ -42,19 +62,37 @@ typedef struct
 {
   frameserializer_state state;    // Current state
   int                   nextqid;  // Next queue id to be assigned
+  size_t                body_ref_min;  // Minimum body length sent by reference, or 0 to always copy
+
+  int                   queue_max;     // Most frames either queue may hold
 
+  // Both queues are rings, with a power of two number of slots
   fs_work_item         *work_queue;         // Array of work items
   int                   work_queue_size;    // Number of slots in work queue
-  int                   work_queue_length;  // Number of contiguous slots filled
+  int                   work_queue_head;    // Slot holding the head item
+  int                   work_queue_length;  // Number of slots filled, starting at the head
 
   fs_completed_item    *completed_queue;         // Array of completed items
   int                   completed_queue_size;    // Number of slots in completed queue
-  int                   completed_queue_length;  // Number of contiguous slots filled
+  int                   completed_queue_head;    // Slot holding the head item
+  int                   completed_queue_length;  // Number of slots filled, starting at the head
 } frameserializer;
 
+wireimage       *wireimage_new(frame *f);
+void             wireimage_ref(wireimage *w);
+void             wireimage_unref(wireimage *w);
+
 frameserializer *frameserializer_new(void);
 void             frameserializer_free(frameserializer *fs);
-int              frameserializer_enqueue_frame(frameserializer *fs, frame *f);
+int              frameserializer_enqueue_frame(frameserializer *fs, frame *f, headerbundle *overlay);
+int              frameserializer_enqueue_wireimage(frameserializer *fs, frame *f, wireimage *w, headerbundle *overlay);
+bool             frameserializer_has_work_frames(frameserializer *fs);
+int              frameserializer_get_work_frame_count(frameserializer *fs);
+bool             frameserializer_is_full(frameserializer *fs);
+bool             frameserializer_get_completed_frame(frameserializer *fs, fs_completed_item *item);
+void             frameserializer_set_body_ref_min(frameserializer *fs, size_t min);
+void             frameserializer_set_queue_max(frameserializer *fs, int max);
 void             frameserializer_serialize(frameserializer *fs, buffer *b);
+ssize_t          frameserializer_output_fd(frameserializer *fs, buffer *b, int fd, bool more);
 
 #endif
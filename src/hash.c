@@ -80,6 +80,13 @@ static uint32_t round_up_pow2(uint32_t v)
   return v;
 }
 
+// Generates the hash key up front. Must be called before any threads that
+//  create hashes are started.
+void hash_init(void)
+{
+  ensure_siphash_key();
+}
+
 hash *hash_new(int sizehint)
 {
   // Generate siphash key, if we don't have one yet
@@ -22,6 +22,7 @@ typedef struct
   int        itemcount;  // Not directly constrained by the bucketcount
 } hash;
 
+void  hash_init(void);
 hash *hash_new(int sizehint);
 void  hash_free(hash *h);
 bool  hash_add(hash *h, const bytestring *key, void *value);
@@ -1,66 +1,365 @@
-#include <string.h>  // strlen()
+#include <string.h>  // strlen(), memchr(), memcmp(), memmove()
+#include <assert.h>  // assert()
 #include "ministompd.h"
 
+struct header_atom_name_item {size_t length; const char *name;};
+
+// Indexed by header atom. Built at compile time, as it is shared by all shards.
+static const struct header_atom_name_item header_atom_names[HDR_ATOM_COUNT] =
+{
+  {14, "accept-version"},
+  {3,  "ack"},
+  {14, "content-length"},
+  {12, "content-type"},
+  {11, "destination"},
+  {10, "heart-beat"},
+  {4,  "host"},
+  {2,  "id"},
+  {5,  "login"},
+  {7,  "message"},
+  {10, "message-id"},
+  {8,  "passcode"},
+  {7,  "receipt"},
+  {10, "receipt-id"},
+  {6,  "server"},
+  {7,  "session"},
+  {12, "subscription"},
+  {11, "transaction"},
+  {7,  "version"}
+};
+
+// Perfect hash of the header atom names, found the same way as the one for
+//  frame commands. Adding an atom means working it out again.
+#define HEADER_ATOM_HASH_SIZE 32
+#define HEADER_ATOM_HASH(name, length) \
+ ((((length) * 2) + ((name)[0] * 11) + ((name)[(length) - 1] * 8)) & (HEADER_ATOM_HASH_SIZE - 1))
+
+// Maps header name hashes to atoms
+static const int8_t header_atom_hash[HEADER_ATOM_HASH_SIZE] =
+{
+  HDR_HOST,
+  HDR_CONTENT_TYPE,
+  HDR_TRANSACTION,
+  HDR_MESSAGE_ID,
+  HDR_NONE,
+  HDR_MESSAGE,
+  HDR_NONE,
+  HDR_ID,
+  HDR_PASSCODE,
+  HDR_ACK,
+  HDR_NONE,
+  HDR_NONE,
+  HDR_HEART_BEAT,
+  HDR_SERVER,
+  HDR_NONE,
+  HDR_SESSION,
+  HDR_VERSION,
+  HDR_NONE,
+  HDR_DESTINATION,
+  HDR_NONE,
+  HDR_RECEIPT,
+  HDR_NONE,
+  HDR_NONE,
+  HDR_ACCEPT_VERSION,
+  HDR_NONE,
+  HDR_SUBSCRIPTION,
+  HDR_RECEIPT_ID,
+  HDR_NONE,
+  HDR_NONE,
+  HDR_CONTENT_LENGTH,
+  HDR_LOGIN,
+  HDR_NONE
+};
+
+const char *header_atom_name(header_atom atom)
+{
+  if ((atom < 0) || (atom >= HDR_ATOM_COUNT))
+    abort();
+
+  return header_atom_names[atom].name;
+}
+
+// Given a header name, returns its atom. Returns HDR_NONE for names that
+//  are not well-known.
+header_atom header_atom_code(const uint8_t *name, size_t length)
+{
+  if (length == 0)
+    return HDR_NONE;
+
+  // The hash only picks a candidate, which still has to match in full
+  int i = header_atom_hash[HEADER_ATOM_HASH(name, length)];
+  if ((i != HDR_NONE) && (length == header_atom_names[i].length) && (memcmp(header_atom_names[i].name, name, length) == 0))
+    return (header_atom) i;
+
+  return HDR_NONE;
+}
+
+// Unescapes header bytes according to the rules used for headers:
+//  "\r" => CR, "\n" => LF, "\c" => ":", "\\" => "\"
+// Returns a new bytestring, or NULL if the input is malformed.
+bytestring *header_unescape(const uint8_t *in, size_t inlen)
+{
+  bytestring *out = bytestring_new(inlen);
+  size_t pos = 0;
+
+  while (pos < inlen)
+  {
+    // Find next backslash
+    const uint8_t *bs = memchr(in + pos, '\\', inlen - pos);
+    if (!bs)
+    {
+      // No backslash, can take the rest of the input verbatim
+      bytestring_append_bytes(out, in + pos, inlen - pos);
+      break;
+    }
+
+    // Copy everything before the backslash
+    size_t bspos = bs - in;
+    if (bspos > pos)
+      bytestring_append_bytes(out, in + pos, bspos - pos);
+
+    // Process the character following the backslash
+    if (inlen == (bspos + 1))
+    {
+      bytestring_free(out);  // There is no following character
+      return NULL;
+    }
+
+    uint8_t c = in[bspos + 1];
+    if (c == '\\')
+      bytestring_append_byte(out, '\\');
+    else if (c == 'r')
+      bytestring_append_byte(out, '\x0D');  // CR
+    else if (c == 'n')
+      bytestring_append_byte(out, '\x0A');  // LF
+    else if (c == 'c')
+      bytestring_append_byte(out, ':');
+    else
+    {
+      bytestring_free(out);  // Invalid escape sequence
+      return NULL;
+    }
+
+    pos = bspos + 2;
+  }
+
+  return out;
+}
+
+// Returns true iff every backslash in the header bytes starts one of the
+//  escape sequences header_unescape() understands.
+bool header_escapes_valid(const uint8_t *in, size_t inlen)
+{
+  size_t pos = 0;
+
+  while (pos < inlen)
+  {
+    const uint8_t *bs = memchr(in + pos, '\\', inlen - pos);
+    if (!bs)
+      return true;
+
+    size_t bspos = bs - in;
+    if (inlen == (bspos + 1))
+      return false;  // There is no following character
+
+    uint8_t c = in[bspos + 1];
+    if ((c != '\\') && (c != 'r') && (c != 'n') && (c != 'c'))
+      return false;  // Invalid escape sequence
+
+    pos = bspos + 2;
+  }
+
+  return true;
+}
+
+// Creates a header block with room for the given number of raw bytes and
+//  slices. The caller holds the only reference, and fills in the bytes.
+headerblock *headerblock_new(size_t length, int slicecount)
+{
+  headerblock *blk = xmalloc(sizeof(headerblock) + (sizeof(bytestring) * slicecount) + length);
+
+  blk->refcount   = 1;
+  blk->slicecount = slicecount;
+  blk->sliceused  = 0;
+  blk->length     = length;
+  blk->slices     = (bytestring *) (blk + 1);
+  blk->data       = (uint8_t *) (blk->slices + slicecount);
+
+  return blk;
+}
+
+// Hands out a bytestring viewing part of the block's bytes. It belongs to
+//  the block, and must not be modified or freed.
+bytestring *headerblock_slice(headerblock *blk, size_t position, size_t length)
+{
+  assert(blk->sliceused < blk->slicecount);
+  assert((position + length) <= blk->length);
+
+  bytestring *bs = &blk->slices[blk->sliceused++];
+  bs->size   = length;
+  bs->length = length;
+  bs->data   = blk->data + position;
+
+  return bs;
+}
+
+void headerblock_ref(headerblock *blk)
+{
+  __atomic_add_fetch(&blk->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void headerblock_unref(headerblock *blk)
+{
+  if (__atomic_sub_fetch(&blk->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    xfree(blk);
+}
+
+// Returns true iff the bytestring is one of the block's slices.
+bool headerblock_has_slice(const headerblock *blk, const bytestring *bs)
+{
+  return (blk != NULL) && (bs >= blk->slices) && (bs < (blk->slices + blk->sliceused));
+}
+
 headerbundle *headerbundle_new(void)
 {
   headerbundle *hb = xmalloc(sizeof(headerbundle));
 
   hb->count   = 0;
   hb->size    = 16;  // A reasonable number of headers for most frames
+  hb->first   = 0;   // Most headers are appended, so leave no room in front
   hb->headers = xmalloc(sizeof(struct header) * hb->size);
+  hb->block   = NULL;
+
+  for (int i = 0; i < HDR_ATOM_COUNT; i++)
+    hb->index[i] = -1;
 
   return hb;
 }
 
-// Resize to at least the given size
+// Sets the header block that the bundle's headers may be sliced from. Takes
+//  over the caller's reference to it.
+void headerbundle_set_block(headerbundle *hb, headerblock *blk)
+{
+  if (hb->block)
+    headerblock_unref(hb->block);
+
+  hb->block = blk;
+}
+
+// Resize to at least the given number of slots
 static void headerbundle_resize(headerbundle *hb, int size)
 {
   // Don't bother if already the given size or larger
   if (size <= hb->size)
     return;
 
-  while (size < hb->size)
+  while (hb->size < size)
     hb->size *= 2;
 
   hb->headers = xrealloc(hb->headers, sizeof(struct header) * hb->size);
 }
 
-// Prepends a key/value pair to the start of the bundle. We take ownership
-//  of the bytestring arguments.
-void headerbundle_prepend_header(headerbundle *hb, bytestring *key, bytestring *val)
+// Moves the headers along to leave free slots in front of them, for
+//  prepending to. The gap is as large as the bundle, so that moves are rare
+//  enough to cost O(1) per prepend overall.
+static void headerbundle_open_front(headerbundle *hb)
 {
-  // Ensure we have room
-  headerbundle_resize(hb, hb->count + 1);
+  int gap = hb->count + 1;
+
+  headerbundle_resize(hb, gap + hb->count);
+  memmove(hb->headers + gap, hb->headers + hb->first, sizeof(struct header) * hb->count);
 
-  // Move each header down by one slot
-  for (int i = hb->count; i > 0; i--)
+  // Indexed slots move along with their headers
+  for (int i = 0; i < HDR_ATOM_COUNT; i++)
   {
-    hb->headers[i].key = hb->headers[i - 1].key;
-    hb->headers[i].val = hb->headers[i - 1].val;
+    if (hb->index[i] >= 0)
+      hb->index[i] += gap - hb->first;
   }
 
+  hb->first = gap;
+}
+
+// Stores a header in the given slot, and indexes it if it is the first one
+//  with its name. Well-known names never need escaping, so an escaped key
+//  never has an atom.
+static void headerbundle_store_header(headerbundle *hb, int slot, bytestring *key, bytestring *val, int escaped, bool first)
+{
+  struct header *h = &hb->headers[slot];
+
+  h->key     = key;
+  h->val     = val;
+  h->escaped = escaped;
+  h->atom    = header_atom_code(bytestring_get_bytes(key), bytestring_get_length(key));
+
+  if ((h->atom != HDR_NONE) && (first || (hb->index[h->atom] < 0)))
+    hb->index[h->atom] = slot;
+}
+
+// Prepends a key/value pair to the start of the bundle. We take ownership
+//  of the bytestring arguments, unless they are slices of the bundle's
+//  header block. The new header hides any later one with the same name.
+void headerbundle_prepend_header(headerbundle *hb, bytestring *key, bytestring *val)
+{
+  // Ensure we have room in front
+  if (hb->first == 0)
+    headerbundle_open_front(hb);
+
   // Add new entry at the beginning
-  hb->headers[0].key = key;
-  hb->headers[0].val = val;
+  hb->first--;
+  headerbundle_store_header(hb, hb->first, key, val, 0, true);
   hb->count++;
 }
 
 // Appends a key/value pair to the end of the bundle. We take ownership of
-//  the bytestring arguments.
+//  the bytestring arguments, unless they are slices of the bundle's header
+//  block.
 void headerbundle_append_header(headerbundle *hb, bytestring *key, bytestring *val)
+{
+  headerbundle_append_escaped_header(hb, key, val, 0);
+}
+
+// Appends a key/value pair whose key and/or value, as given by the
+//  HEADER_ESCAPED_* flags, are still escaped as they were on the wire. They
+//  are unescaped when first read. The escapes must already have been checked
+//  with header_escapes_valid().
+void headerbundle_append_escaped_header(headerbundle *hb, bytestring *key, bytestring *val, int escaped)
 {
   // Ensure we have room
-  headerbundle_resize(hb, hb->count + 1);
+  headerbundle_resize(hb, hb->first + hb->count + 1);
 
   // Add new entry at the end
-  hb->headers[hb->count].key = key;
-  hb->headers[hb->count].val = val;
+  headerbundle_store_header(hb, hb->first + hb->count, key, val, escaped, false);
   hb->count++;
 }
 
+// Replaces an escaped key or value with its unescaped form.
+static bytestring *headerbundle_unescape_part(headerbundle *hb, bytestring *raw)
+{
+  bytestring *bs = header_unescape(bytestring_get_bytes(raw), bytestring_get_length(raw));
+  assert(bs != NULL);  // Escapes were checked when the header was added
+
+  if (!headerblock_has_slice(hb->block, raw))
+    bytestring_free(raw);
+
+  return bs;
+}
+
+// Unescapes whatever is still escaped in a header, so it can be read.
+static void headerbundle_unescape_header(headerbundle *hb, struct header *h)
+{
+  if (h->escaped & HEADER_ESCAPED_KEY)
+    h->key = headerbundle_unescape_part(hb, h->key);
+  if (h->escaped & HEADER_ESCAPED_VAL)
+    h->val = headerbundle_unescape_part(hb, h->val);
+
+  h->escaped = 0;
+}
+
 // Returns true iff the bundle has a header with the given index. If the key
 //  and/or val pointers are provided, they will be filled in with a pointer
-//  to the respective bytestring.
+//  to the respective bytestring. An escaped header is unescaped in place on
+//  first read, so this must not be used on a bundle that another shard may
+//  be reading at the same time; use headerbundle_get_raw_header() there.
 bool headerbundle_get_header(headerbundle *hb, int index, const bytestring **key, const bytestring **val)
 {
   // Bounds check
@@ -68,22 +367,82 @@ bool headerbundle_get_header(headerbundle *hb, int index, const bytestring **key
     return false;  // No such header
 
   // Fill in pointers, if needed
+  struct header *h = &hb->headers[hb->first + index];
+  if (h->escaped)
+    headerbundle_unescape_header(hb, h);
+
   if (key)
-    *key = hb->headers[index].key;
+    *key = h->key;
   if (val)
-    *val = hb->headers[index].val;
+    *val = h->val;
+
+  return true;
+}
+
+// Like headerbundle_get_header(), but gives the key and value as they are
+//  stored, without unescaping them. The escaped pointer is filled in with
+//  HEADER_ESCAPED_* flags saying which of them are still escaped. Never
+//  changes the bundle, so it is safe on frames shared between shards.
+bool headerbundle_get_raw_header(const headerbundle *hb, int index, const bytestring **key, const bytestring **val, int *escaped)
+{
+  // Bounds check
+  if ((index < 0) || (index >= hb->count))
+    return false;  // No such header
+
+  const struct header *h = &hb->headers[hb->first + index];
+  *key     = h->key;
+  *val     = h->val;
+  *escaped = h->escaped;
 
   return true;
 }
 
+// Returns the value of the first header in the bundle with the given
+//  well-known name. Returns NULL on no match. Unescapes in place, as
+//  headerbundle_get_header() does.
+const bytestring *headerbundle_get_header_value_by_atom(headerbundle *hb, header_atom atom)
+{
+  int slot = hb->index[atom];
+  if (slot < 0)
+    return NULL;  // No match
+
+  struct header *h = &hb->headers[slot];
+  if (h->escaped)
+    headerbundle_unescape_header(hb, h);
+
+  return h->val;
+}
+
+// Like headerbundle_get_header_value_by_atom(), but gives the value as it is
+//  stored, with the escaped pointer filled in as for
+//  headerbundle_get_raw_header(). Safe on frames shared between shards.
+const bytestring *headerbundle_get_raw_header_value_by_atom(const headerbundle *hb, header_atom atom, int *escaped)
+{
+  int slot = hb->index[atom];
+  if (slot < 0)
+    return NULL;  // No match
+
+  *escaped = hb->headers[slot].escaped;
+  return hb->headers[slot].val;
+}
+
 // Returns the value of the first header in the bundle whose key matches the
-//  given string. Returns NULL on no match.
+//  given string. Returns NULL on no match. Well-known names are found
+//  through the index, and anything else by a scan, which unescapes every
+//  header it passes in place.
 const bytestring *headerbundle_get_header_value_by_str(headerbundle *hb, const char *key)
 {
   int keylen = strlen(key);
 
-  for (int i = 0; i < hb->count; i++)
+  header_atom atom = header_atom_code((const uint8_t *) key, keylen);
+  if (atom != HDR_NONE)
+    return headerbundle_get_header_value_by_atom(hb, atom);
+
+  for (int i = hb->first; i < (hb->first + hb->count); i++)
   {
+    if (hb->headers[i].escaped)
+      headerbundle_unescape_header(hb, &hb->headers[i]);
+
     bytestring *headerkey = hb->headers[i].key;
     if (bytestring_get_length(headerkey) == keylen)
     {
@@ -97,25 +456,30 @@ const bytestring *headerbundle_get_header_value_by_str(headerbundle *hb, const c
 
 void headerbundle_dump(headerbundle *hb)
 {
-  printf("headerbundle at %p count %d size %d\n", hb, hb->count, hb->size);
+  printf("headerbundle at %p count %d size %d first %d\n", hb, hb->count, hb->size, hb->first);
 
   for (int i = 0; i < hb->count; i++)
   {
     printf("Header %d:\n", i);
-    bytestring_dump(hb->headers[i].key);
-    bytestring_dump(hb->headers[i].val);
+    bytestring_dump(hb->headers[hb->first + i].key);
+    bytestring_dump(hb->headers[hb->first + i].val);
   }
 }
 
 void headerbundle_free(headerbundle *hb)
 {
-  // Free header contents
-  for (int i = 0; i < hb->count; i++)
+  // Free header contents, apart from slices of the header block
+  for (int i = hb->first; i < (hb->first + hb->count); i++)
   {
-    bytestring_free(hb->headers[i].key);
-    bytestring_free(hb->headers[i].val);
+    if (!headerblock_has_slice(hb->block, hb->headers[i].key))
+      bytestring_free(hb->headers[i].key);
+    if (!headerblock_has_slice(hb->block, hb->headers[i].val))
+      bytestring_free(hb->headers[i].val);
   }
 
+  if (hb->block)
+    headerblock_unref(hb->block);
+
   // Free array of header structs
   xfree(hb->headers);
 
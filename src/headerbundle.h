@@ -1,23 +1,91 @@
 #ifndef MINISTOMPD_HEADERBUNDLE_H
 #define MINISTOMPD_HEADERBUNDLE_H
 
+// Well-known header names, interned so that lookups are integer compares
+typedef enum
+{
+  HDR_ACCEPT_VERSION,
+  HDR_ACK,
+  HDR_CONTENT_LENGTH,
+  HDR_CONTENT_TYPE,
+  HDR_DESTINATION,
+  HDR_HEART_BEAT,
+  HDR_HOST,
+  HDR_ID,
+  HDR_LOGIN,
+  HDR_MESSAGE,
+  HDR_MESSAGE_ID,
+  HDR_PASSCODE,
+  HDR_RECEIPT,
+  HDR_RECEIPT_ID,
+  HDR_SERVER,
+  HDR_SESSION,
+  HDR_SUBSCRIPTION,
+  HDR_TRANSACTION,
+  HDR_VERSION,
+
+  HDR_ATOM_COUNT  // Number of header atoms defined
+} header_atom;
+
+#define HDR_NONE (-1)
+
+// A copy of a frame's raw header lines, which parsed headers are sliced
+//  from instead of each being copied out separately. The slices and bytes
+//  share one allocation. Refcounted, as frames may be freed on another shard.
+typedef struct
+{
+  int         refcount;    // References held by bundles
+  int         slicecount;  // Number of slices allocated
+  int         sliceused;   // Number of slices handed out
+  size_t      length;      // Count of raw bytes
+  bytestring *slices;      // Views of parts of the raw bytes, for use as header keys and values
+  uint8_t    *data;        // Raw bytes
+} headerblock;
+
+// Flags for the parts of a header that are still escaped as on the wire
+#define HEADER_ESCAPED_KEY 0x01
+#define HEADER_ESCAPED_VAL 0x02
+
 struct header
 {
-  bytestring *key;
-  bytestring *val;
+  bytestring *key;      // Owned, unless it is a slice of the bundle's header block
+  bytestring *val;      // Likewise
+  header_atom atom;     // Atom for the key, or HDR_NONE if it is not well-known
+  int         escaped;  // HEADER_ESCAPED_* flags
 };
 
+// Headers are kept in order in part of an array, with free slots after them
+//  for appends and, once anything has been prepended, before them too.
 typedef struct
 {
-  int            count;    // Number of headers stored
-  int            size;     // Number of possible headers that fit in allocated memory
-  struct header *headers;  // Array of headers
+  int            count;                  // Number of headers stored
+  int            size;                   // Number of possible headers that fit in allocated memory
+  int            first;                  // Slot of the first header
+  struct header *headers;                // Array of header slots
+  headerblock   *block;                  // Header block that headers may be sliced from, or NULL
+  int            index[HDR_ATOM_COUNT];  // Slot of the first header with each well-known name, or -1
 } headerbundle;
 
+headerblock      *headerblock_new(size_t length, int slicecount);
+bytestring       *headerblock_slice(headerblock *blk, size_t position, size_t length);
+bool              headerblock_has_slice(const headerblock *blk, const bytestring *bs);
+void              headerblock_ref(headerblock *blk);
+void              headerblock_unref(headerblock *blk);
+
+const char       *header_atom_name(header_atom atom);
+header_atom       header_atom_code(const uint8_t *name, size_t length);
+bytestring       *header_unescape(const uint8_t *in, size_t inlen);
+bool              header_escapes_valid(const uint8_t *in, size_t inlen);
+
 headerbundle     *headerbundle_new(void);
+void              headerbundle_set_block(headerbundle *hb, headerblock *blk);
 void              headerbundle_prepend_header(headerbundle *hb, bytestring *key, bytestring *val);
 void              headerbundle_append_header(headerbundle *hb, bytestring *key, bytestring *val);
+void              headerbundle_append_escaped_header(headerbundle *hb, bytestring *key, bytestring *val, int escaped);
 bool              headerbundle_get_header(headerbundle *hb, int index, const bytestring **key, const bytestring **val);
+bool              headerbundle_get_raw_header(const headerbundle *hb, int index, const bytestring **key, const bytestring **val, int *escaped);
+const bytestring *headerbundle_get_header_value_by_atom(headerbundle *hb, header_atom atom);
+const bytestring *headerbundle_get_raw_header_value_by_atom(const headerbundle *hb, header_atom atom, int *escaped);
 const bytestring *headerbundle_get_header_value_by_str(headerbundle *hb, const char *key);
 void              headerbundle_dump(headerbundle *hb);
 void              headerbundle_free(headerbundle *hb);
@@ -60,6 +60,19 @@ void list_remove(list *l, int i)
   l->length--;
 }
 
+// Removes count items starting at slot i, with a single move of the rest.
+void list_remove_range(list *l, int i, int count)
+{
+  assert(i >= 0);
+  assert(count >= 0);
+  assert(i + count <= l->length);
+
+  if (i + count < l->length)
+    memmove(l->items + i, l->items + i + count, sizeof(void *) * (l->length - i - count));
+
+  l->length -= count;
+}
+
 void list_push(list *l, void *item)
 {
   int len = l->length + 1;
@@ -94,6 +107,22 @@ void *list_shift(list *l)
   return item;
 }
 
+void list_unshift(list *l, void *item)
+{
+  list_ensure_size(l, l->length + 1);
+
+  if (l->length)
+    memmove(l->items + 1, l->items, l->length * sizeof(*l->items));
+
+  l->items[0] = item;
+  l->length++;
+}
+
+void list_clear(list *l)
+{
+  l->length = 0;
+}
+
 void list_free(list *l)
 {
   xfree(l->items);
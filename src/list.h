@@ -11,9 +11,12 @@ typedef struct
 list *list_new(int size);
 int   list_search(const list *l, void *ptr);
 void  list_remove(list *l, int i);
+void  list_remove_range(list *l, int i, int count);
 void  list_push(list *l, void *item);
 void *list_pop(list *l);
 void *list_shift(list *l);
+void  list_unshift(list *l, void *item);
+void  list_clear(list *l);
 void  list_free(list *l);
 
 static inline int list_get_length(const list *l)
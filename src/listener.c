@@ -1,14 +1,18 @@
+#define _GNU_SOURCE  // accept4(), SO_REUSEPORT
+
 #include <string.h>  // memcpy()
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>  // TCP_NODELAY
 #include <stdbool.h>
+#include <time.h>  // clock_gettime()
+#include <inttypes.h>  // PRIu64
 #include "ministompd.h"
 
-#define LISTENER_LISTEN_BACKLOG 10
-
 static bool ipv4_str_to_sockaddr(const char *ipaddr, uint16_t port, struct sockaddr_storage *sockaddr)
 {
   struct sockaddr_in addr;
@@ -37,6 +41,8 @@ static bool ipv6_str_to_sockaddr(const char *ipaddr, uint16_t port, struct socka
   return true;
 }
 
+static void listener_resume(timer *t, void *data);
+
 listener *listener_new(void)
 {
   // Allocate memory
@@ -47,6 +53,17 @@ listener *listener_new(void)
   l->fd = -1;
   l->status = LISTENER_STATUS_OK;
   l->lasterrno = 0;
+  l->reuseport = false;
+  l->backlog   = DEFAULT_LISTEN_BACKLOG;
+  l->epollfd   = -1;
+  l->paused    = false;
+  l->retry_ms  = LISTENER_RETRY_MIN;
+
+  timer_init(&l->retry_timer, listener_resume, l);
+
+  memset(&l->stats, 0, sizeof(l->stats));
+  if (clock_gettime(CLOCK_MONOTONIC, &l->stats.sincetime))
+    abort();  // Couldn't get time
 
   return l;
 }
@@ -64,6 +81,22 @@ bool listener_set_address(listener *l, const char *ipaddr, uint16_t port)
   return true;
 }
 
+// Allows several listeners, typically one per shard, to bind the same
+//  address. The kernel then spreads incoming connections across them. Must
+//  be set before listener_listen().
+void listener_set_reuseport(listener *l, bool reuseport)
+{
+  l->reuseport = reuseport;
+}
+
+// Sets the length of the kernel's queue of pending connections. The kernel
+//  silently caps this at net.core.somaxconn. Must be set before
+//  listener_listen().
+void listener_set_backlog(listener *l, int backlog)
+{
+  l->backlog = backlog;
+}
+
 bool listener_listen(listener *l)
 {
   // Sanity check
@@ -91,6 +124,14 @@ bool listener_listen(listener *l)
     return false;  // Cannot set SO_REUSEADDR option
   }
 
+  // Turn on SO_REUSEPORT, if wanted
+  if (l->reuseport && (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == -1))
+  {
+    l->lasterrno = errno;
+    l->status = LISTENER_STATUS_ERROR;
+    return false;  // Cannot set SO_REUSEPORT option
+  }
+
   // Turn on O_NONBLOCK
   int flags = fcntl(fd, F_GETFL);
   if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
@@ -109,7 +150,7 @@ bool listener_listen(listener *l)
   }
 
   // Listen on the socket
-  if (listen(fd, LISTENER_LISTEN_BACKLOG) == -1)
+  if (listen(fd, l->backlog) == -1)
   {
     l->lasterrno = errno;
     l->status = LISTENER_STATUS_ERROR;
@@ -120,35 +161,81 @@ bool listener_listen(listener *l)
   return true;
 }
 
-// Marks fds for watching by a later select() call. Returns the highest known fd.
-int listener_mark_fds(listener *l, int highfd, fd_set *readfds, fd_set *writefds)
+// Registers the listening fd with the given epoll instance. The listener
+//  itself is used as the event's data pointer. Returns true on success.
+bool listener_watch(listener *l, int epollfd)
 {
   // Bail out if we're not actually listening
   if (l->status != LISTENER_STATUS_OK)
-    return highfd;
+    return false;
 
-  if (highfd < l->fd)
-    highfd = l->fd;
+  struct epoll_event ev;
+  ev.events   = EPOLLIN;
+  ev.data.ptr = l;
+  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, l->fd, &ev) == -1)
+  {
+    l->lasterrno = errno;
+    return false;  // Cannot watch fd
+  }
 
-  // Select for reading
-  FD_SET(l->fd, readfds);
+  l->epollfd = epollfd;
 
-  return highfd;
+  return true;
 }
 
-// Accepts a new connection, if possible, and returns it. If there is nothing
-//  to accept, returns NULL. If the caller supplies the 'readfds' arg, no
-//  work is done unless the listening fd is active in that set.
-connection *listener_accept_connection(listener *l, fd_set *readfds)
+// Stops watching the listening fd for a while, after running out of fds or
+//  memory. The fd is level-triggered, so leaving it in the epoll set would
+//  wake the loop straight back up for the same connections. They wait in the
+//  kernel's queue instead, and the retry timer puts the fd back, waiting
+//  twice as long each time resources are still short.
+static void listener_pause(listener *l)
+{
+  if (l->paused)
+    return;
+
+  if (epoll_ctl(l->epollfd, EPOLL_CTL_DEL, l->fd, NULL) == -1)
+  {
+    log_perror(LOG_LEVEL_ERROR, "epoll_ctl()");
+    exit(1);
+  }
+
+  log_printf(LOG_LEVEL_ERROR, "Out of resources accepting connections on listener %p; pausing for %d ms.\n", l, l->retry_ms);
+
+  timerwheel *tw = shard_self()->timers;
+  timerwheel_schedule(tw, &l->retry_timer, tw->now + l->retry_ms);
+
+  l->paused = true;
+  l->stats.pauses++;
+
+  l->retry_ms *= 2;
+  if (l->retry_ms > LISTENER_RETRY_MAX)
+    l->retry_ms = LISTENER_RETRY_MAX;
+}
+
+// Puts the listening fd back in the epoll set once a pause is over. Anything
+//  still queued wakes the loop right away.
+static void listener_resume(timer *t, void *data)
 {
-  // Double check the fd_set, if one was supplied
-  if ((readfds != NULL) && !FD_ISSET(l->fd, readfds))
-    return NULL;  // Our fd was not active in the set
+  listener *l = data;
 
-  // Attempt to accept connection
+  int epollfd = l->epollfd;
+  l->paused = false;
+  if (!listener_watch(l, epollfd))
+  {
+    log_printf(LOG_LEVEL_ERROR, "Couldn't watch listening socket: %s\n", strerror(l->lasterrno));
+    exit(1);
+  }
+}
+
+// Accepts a new connection, if possible, and returns it. If there is nothing
+//  to accept, or the attempt failed, returns NULL.
+connection *listener_accept_connection(listener *l)
+{
+  // Attempt to accept connection. The new socket comes back non-blocking and
+  //  close-on-exec, saving two fcntl() calls.
   struct sockaddr_storage addr;
   socklen_t addrlen = sizeof(addr);
-  int fd = accept(l->fd, (struct sockaddr *)&addr, &addrlen);
+  int fd = accept4(l->fd, (struct sockaddr *)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
   // Handle errors
   if (fd < 0)
@@ -158,18 +245,34 @@ connection *listener_accept_connection(listener *l, fd_set *readfds)
     if ((err == EAGAIN) || (err == EWOULDBLOCK))
       return NULL;  // Nothing to accept
 
+    // Out of fds or memory. Leave the rest queued in the kernel until
+    //  things ease off.
+    if ((err == EMFILE) || (err == ENFILE) || (err == ENOBUFS) || (err == ENOMEM))
+    {
+      l->stats.no_resources++;
+      listener_pause(l);
+      return NULL;
+    }
+
+    l->stats.errors++;
+
+    // The client went away before we got to it; nothing to worry about
+    if ((err == ECONNABORTED) || (err == EPROTO) || (err == EINTR))
+      return NULL;
+
     // Unexpected error, bail out
-    log_perror(LOG_LEVEL_ERROR, "accept()");
+    log_perror(LOG_LEVEL_ERROR, "accept4()");
     exit(1);
   }
 
-  // Turn on O_NONBLOCK
-  int flags = fcntl(fd, F_GETFL);
-  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
-  {
-    log_perror(LOG_LEVEL_ERROR, "fcntl()");
-    exit(1);
-  }
+  l->stats.accepted++;
+  l->retry_ms = LISTENER_RETRY_MIN;  // Resources are back
+
+  // Output is grouped into writes by the connection itself, so Nagle's
+  //  algorithm would only hold back the tail of each burst
+  int nodelay = 1;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1)
+    log_perror(LOG_LEVEL_DEBUG, "setsockopt(TCP_NODELAY)");
 
   // Wrap the new connection
   connection *c = connection_new(CONNECTION_STATUS_LOGIN, fd);
@@ -177,6 +280,48 @@ connection *listener_accept_connection(listener *l, fd_set *readfds)
   return c;
 }
 
+// Accepts up to 'budget' pending connections, appending each to the given
+//  list. The budget keeps existing connections serviced during connection
+//  storms; anything left over is picked up on the next wakeup. Returns the
+//  number of connections accepted.
+int listener_accept_connections(listener *l, list *accepted, int budget)
+{
+  int count = 0;
+
+  while (count < budget)
+  {
+    connection *c = listener_accept_connection(l);
+    if (c == NULL)
+      break;  // Queue drained, or an error occurred
+
+    list_push(accepted, c);
+    count++;
+  }
+
+  l->stats.batches++;
+  if (count >= budget)
+    l->stats.budget_exhausted++;
+
+  return count;
+}
+
+// Logs accept counters, along with the accept rate since the previous call.
+void listener_dump_stats(listener *l)
+{
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now))
+    abort();  // Couldn't get time
+
+  double elapsed = (now.tv_sec - l->stats.sincetime.tv_sec) + ((now.tv_nsec - l->stats.sincetime.tv_nsec) / 1e9);
+  uint64_t recent = l->stats.accepted - l->stats.sinceaccepted;
+
+  log_printf(LOG_LEVEL_INFO, "Listener %p: accepted %" PRIu64 " (%.1f/s), batches %" PRIu64 ", budget exhausted %" PRIu64 ", errors %" PRIu64 ", out of resources %" PRIu64 " (%" PRIu64 " pauses)\n",
+    l, l->stats.accepted, (elapsed > 0) ? (recent / elapsed) : 0.0, l->stats.batches, l->stats.budget_exhausted, l->stats.errors, l->stats.no_resources, l->stats.pauses);
+
+  l->stats.sincetime     = now;
+  l->stats.sinceaccepted = l->stats.accepted;
+}
+
 void listener_free(listener *l)
 {
   xfree(l->sockaddr);
@@ -1,4 +1,6 @@
-#include <sys/select.h>  // fd_set
+#include <sys/socket.h>  // struct sockaddr_storage
+#include <stdint.h>      // uint64_t
+#include <time.h>        // struct timespec
 
 #ifndef MINISTOMPD_LISTENER_H
 #define MINISTOMPD_LISTENER_H
@@ -9,19 +11,42 @@ enum listener_status
   LISTENER_STATUS_ERROR
 };
 
+struct listener_stats
+{
+  uint64_t        accepted;          // Connections accepted
+  uint64_t        batches;           // Calls to listener_accept_connections()
+  uint64_t        budget_exhausted;  // Batches that stopped at the budget with more possibly queued
+  uint64_t        errors;            // Failed accept4() calls, other than for lack of resources
+  uint64_t        no_resources;      // accept4() calls that failed for lack of fds or memory
+  uint64_t        pauses;            // Times accepting was paused to let resources free up
+  struct timespec sincetime;         // Time of the last stats dump
+  uint64_t        sinceaccepted;     // Value of 'accepted' at the last stats dump
+};
+
 typedef struct
 {
-  int                      fd;         // Listening fd
-  enum listener_status     status;     // Current status
-  int                      lasterrno;  // Errno from last known error
-  struct sockaddr_storage *sockaddr;   // Socket address to listen on
+  int                      fd;           // Listening fd
+  enum listener_status     status;       // Current status
+  int                      lasterrno;    // Errno from last known error
+  struct sockaddr_storage *sockaddr;     // Socket address to listen on
+  bool                     reuseport;    // Share the address with other listeners via SO_REUSEPORT
+  int                      backlog;      // Length of the kernel's pending connection queue
+  int                      epollfd;      // Epoll instance watching the fd, or -1
+  bool                     paused;       // Out of the epoll set until the retry timer fires
+  int                      retry_ms;     // Length of the next pause, doubling while resources stay short
+  timer                    retry_timer;  // Puts the fd back in the epoll set after a pause
+  struct listener_stats    stats;        // Accept counters
 } listener;
 
 listener   *listener_new(void);
 bool        listener_set_address(listener *l, const char *ipaddr, uint16_t port);
+void        listener_set_reuseport(listener *l, bool reuseport);
+void        listener_set_backlog(listener *l, int backlog);
 bool        listener_listen(listener *l);
-int         listener_mark_fds(listener *l, int highfd, fd_set *readfds, fd_set *writefds);
-connection *listener_accept_connection(listener *l, fd_set *readfds);
+bool        listener_watch(listener *l, int epollfd);
+connection *listener_accept_connection(listener *l);
+int         listener_accept_connections(listener *l, list *accepted, int budget);
+void        listener_dump_stats(listener *l);
 void        listener_free(listener *l);
 
 #endif
@@ -20,7 +20,7 @@ bool log_check_level(log_level lvl)
   return (lvl <= level);
 }
 
-bool log_printf(log_level lvl, const char *fmt, ...)
+bool log_write(log_level lvl, const char *fmt, ...)
 {
   va_list args;
 
@@ -44,9 +44,9 @@ bool log_printf(log_level lvl, const char *fmt, ...)
   return true;
 }
 
-bool log_perror(log_level lvl, const char *msg)
+bool log_write_error(log_level lvl, const char *msg)
 {
   int err = errno;
 
-  return log_printf(lvl, "%s: %s\n", msg, strerror(err));
+  return log_write(lvl, "%s: %s\n", msg, strerror(err));
 }
@@ -6,16 +6,32 @@
 
 typedef enum
 {
-  LOG_LEVEL_NONE,
-  LOG_LEVEL_ERROR,
-  LOG_LEVEL_INFO,
-  LOG_LEVEL_VERBOSE,
-  LOG_LEVEL_DEBUG
+  LOG_LEVEL_NONE    = 0,
+  LOG_LEVEL_ERROR   = 1,
+  LOG_LEVEL_INFO    = 2,
+  LOG_LEVEL_VERBOSE = 3,
+  LOG_LEVEL_DEBUG   = 4
 } log_level;
 
+// Most detailed level built into the program. Logging and dumps above it
+//  compile to nothing, and their arguments are never evaluated. Override
+//  with -DLOG_COMPILE_LEVEL=LOG_LEVEL_DEBUG to keep debug output.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_VERBOSE
+#endif
+
+#define log_enabled(lvl) (((lvl) <= LOG_COMPILE_LEVEL) && log_check_level(lvl))
+
+#define log_printf(lvl, ...) ((void) (log_enabled(lvl) && log_write((lvl), __VA_ARGS__)))
+#define log_perror(lvl, msg) ((void) (log_enabled(lvl) && log_write_error((lvl), (msg))))
+
+// Runs a statement, such as a call to one of the *_dump() functions, only
+//  when the given level is enabled.
+#define log_dump(lvl, stmt) do { if (log_enabled(lvl)) { stmt; } } while (0)
+
 void log_set_level(log_level lvl);
 bool log_check_level(log_level lvl);
-bool log_printf(log_level lvl, const char *fmt, ...);
-bool log_perror(log_level lvl, const char *msg);
+bool log_write(log_level lvl, const char *fmt, ...);
+bool log_write_error(log_level lvl, const char *msg);
 
 #endif
@@ -0,0 +1,51 @@
+#include "ministompd.h"
+
+static clockid_t clock_id = CLOCK_MONOTONIC;
+
+static __thread struct timespec cached_ts;          // Time of the last refresh on this thread
+static __thread uint64_t        cached_ms;          // Likewise, in milliseconds
+static __thread bool            cached    = false;  // Whether this thread has refreshed yet
+
+// Selects the tick-granularity clock, which is cheaper to read but only
+//  accurate to a few milliseconds. Must be called before any shard threads
+//  are started. Returns false if the system doesn't have one.
+bool loopclock_set_coarse(bool coarse)
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_id = coarse ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC;
+  return true;
+#else
+  clock_id = CLOCK_MONOTONIC;
+  return !coarse;
+#endif
+}
+
+// Reads the clock into this thread's cache. Returns the time in milliseconds.
+uint64_t loopclock_refresh(void)
+{
+  if (clock_gettime(clock_id, &cached_ts))
+    abort();  // Couldn't get time
+
+  cached_ms = ((uint64_t) cached_ts.tv_sec * 1000) + (cached_ts.tv_nsec / 1000000);
+  cached    = true;
+
+  return cached_ms;
+}
+
+// Returns the cached time.
+struct timespec loopclock_now(void)
+{
+  if (!cached)
+    loopclock_refresh();
+
+  return cached_ts;
+}
+
+// Returns the cached time, in milliseconds.
+uint64_t loopclock_now_ms(void)
+{
+  if (!cached)
+    loopclock_refresh();
+
+  return cached_ms;
+}
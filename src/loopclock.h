@@ -0,0 +1,17 @@
+#include <stdint.h>   // uint64_t
+#include <stdbool.h>
+#include <time.h>     // struct timespec
+
+#ifndef MINISTOMPD_LOOPCLOCK_H
+#define MINISTOMPD_LOOPCLOCK_H
+
+// Each event loop thread keeps a cached reading of the monotonic clock,
+//  refreshed when the loop wakes up, so that timestamps on I/O and frames
+//  don't cost a clock read each.
+
+bool            loopclock_set_coarse(bool coarse);
+uint64_t        loopclock_refresh(void);
+struct timespec loopclock_now(void);
+uint64_t        loopclock_now_ms(void);
+
+#endif
@@ -1,155 +1,464 @@
-#include <sys/types.h>  // open()
-#include <sys/stat.h>   // open()
-#include <fcntl.h>      // open()
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <unistd.h>  // STDIN_FILENO
 #include <signal.h>  // signal()
 #include <string.h>  // strerror()
+#include <errno.h>
 #include "ministompd.h"
 
-listener *l;
-
 queue *q;
 
-void loop(void);
-void parse_file(char *filename);
+io_engine engine = IO_ENGINE_POSIX;
+
+volatile sig_atomic_t stats_generation = 0;  // Bumped for each stats request
+
+void loop(shard *s);
 void handle_connection(connection *c);
-void handle_connection_input(connection *c);
+void handle_connection_buffered(connection *c, size_t readcount);
+void handle_connection_input(connection *c, size_t readcount);
+void handle_connection_input_frames(connection *c, frame **frames, int count);
 void handle_connection_input_frame(connection *c, frame *f);
 void handle_connection_output(connection *c);
 void reap_connection(connection *c);
+void handle_stats_signal(int signum);
 
 int main(int argc, char *argv[])
 {
+  // Parse command line options
+  int opt;
+  int threads = 1;
+  int backlog = DEFAULT_LISTEN_BACKLOG;
+  log_level verbosity = LOG_LEVEL_INFO;
+  struct connection_watermarks wm =
+  {
+    .output_high = DEFAULT_OUTPUT_HIGH_WATER,
+    .output_low  = DEFAULT_OUTPUT_LOW_WATER,
+    .queued_high = DEFAULT_QUEUED_HIGH_WATER,
+    .queued_low  = DEFAULT_QUEUED_LOW_WATER,
+    .queued_max  = DEFAULT_QUEUED_MAX
+  };
+  while ((opt = getopt(argc, argv, "b:Ce:q:t:vw:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'b':
+      backlog = atoi(optarg);
+      if (backlog < 1)
+      {
+        log_printf(LOG_LEVEL_ERROR, "Listen backlog must be at least 1.\n");
+        exit(1);
+      }
+      break;
+    case 'C':
+      if (!loopclock_set_coarse(true))
+      {
+        log_printf(LOG_LEVEL_ERROR, "No coarse monotonic clock on this system.\n");
+        exit(1);
+      }
+      break;
+    case 'e':
+      if (strcmp(optarg, "posix") == 0)
+        engine = IO_ENGINE_POSIX;
+      else if (strcmp(optarg, "uring") == 0)
+        engine = IO_ENGINE_URING;
+      else
+      {
+        log_printf(LOG_LEVEL_ERROR, "Unknown I/O engine '%s'.\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'q':
+      wm.queued_max = atoi(optarg);
+      if (wm.queued_max < 1)
+      {
+        log_printf(LOG_LEVEL_ERROR, "Per-connection frame cap must be at least 1.\n");
+        exit(1);
+      }
+      break;
+    case 't':
+      threads = atoi(optarg);
+      if ((threads < 1) || (threads > SHARD_COUNT_MAX))
+      {
+        log_printf(LOG_LEVEL_ERROR, "Thread count must be between 1 and %d.\n", SHARD_COUNT_MAX);
+        exit(1);
+      }
+      break;
+    case 'v':
+      // Each -v enables one more level, as far as the build allows
+      if (verbosity < LOG_LEVEL_DEBUG)
+        verbosity++;
+      break;
+    case 'w':
+      if ((sscanf(optarg, "%zu,%zu", &wm.output_high, &wm.output_low) != 2) || (wm.output_low > wm.output_high))
+      {
+        log_printf(LOG_LEVEL_ERROR, "Output watermarks must be given as <high>,<low> bytes, with low <= high.\n");
+        exit(1);
+      }
+      break;
+    default:
+      exit(1);
+    }
+  }
+
+  log_set_level(verbosity);
+  if (verbosity > LOG_COMPILE_LEVEL)
+    log_printf(LOG_LEVEL_ERROR, "Logging above level %d is not built in.\n", LOG_COMPILE_LEVEL);
+
   log_printf(LOG_LEVEL_INFO, "Starting up.\n");
 
   // Ignore SIGPIPE
   signal(SIGPIPE, SIG_IGN);
 
-  // Create a new listener
-  l = listener_new();
-  if (!listener_set_address(l, "::1", 61613))
-  {
-    log_printf(LOG_LEVEL_ERROR, "Couldn't set listening address.\n");
-    exit(1);
-  }
-  else if (!listener_listen(l))
+  // Dump stats on request
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_stats_signal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+
+  // Shared state must be set up before any shard threads start
+  hash_init();
+  bytescan_init();
+  connection_set_default_watermarks(&wm);
+  shard_setup(threads);
+
+  // Create a listener for each shard
+  for (int i = 0; i < threads; i++)
   {
-    log_printf(LOG_LEVEL_ERROR, "Couldn't listen on socket.\n");
-    exit(1);
+    listener *l = listener_new();
+    listener_set_reuseport(l, (threads > 1));
+    listener_set_backlog(l, backlog);
+    if (!listener_set_address(l, "::1", 61613))
+    {
+      log_printf(LOG_LEVEL_ERROR, "Couldn't set listening address.\n");
+      exit(1);
+    }
+    else if (!listener_listen(l))
+    {
+      log_printf(LOG_LEVEL_ERROR, "Couldn't listen on socket.\n");
+      exit(1);
+    }
+
+    shard_get(i)->listener = l;
   }
 
   // Create queue
   queueconfig *qc = queueconfig_new();
   q = queue_new(bytestring_new_from_string("test"), qc);
+  q->home_shard = shard_home_for_queue(q->name);
 
-  // Run event loop
-  loop();
+  // Run an event loop per shard, the first on this thread
+  for (int i = 1; i < threads; i++)
+  {
+    if (!shard_start(shard_get(i), loop))
+    {
+      log_perror(LOG_LEVEL_ERROR, "pthread_create()");
+      exit(1);
+    }
+  }
+
+  loop(shard_get(0));
+
+  for (int i = 1; i < threads; i++)
+    shard_join(shard_get(i));
 
-  // Clean up listener
-  listener_free(l);
+  // Clean up listeners
+  for (int i = 0; i < threads; i++)
+    listener_free(shard_get(i)->listener);
 
   return 0;
 }
 
-void loop(void)
+void loop(shard *s)
 {
-  connectionbundle *cb = connectionbundle_new();
+  listener *l = s->listener;
 
-  bool done = false;
+  // Set up the io_uring engine, if selected
+  uring *u = NULL;
+  if (engine == IO_ENGINE_URING)
+  {
+    u = uring_new(URING_QUEUE_DEPTH);
+    if (!u)
+    {
+      log_printf(LOG_LEVEL_ERROR, "Couldn't set up io_uring engine.\n");
+      exit(1);
+    }
+  }
 
-  while (!done)
+  connectionbundle *cb = connectionbundle_new(u);
+
+  // Heartbeats, timeouts and expiry run off this shard's timers
+  s->timers = timerwheel_new(loopclock_refresh());
+
+  // Bind this thread to the shard, and watch for messages from other shards
+  s->bundle = cb;
+  shard_enter(s);
+
+  // Watch the ring for completions
+  if (u && !uring_watch(u, cb->epollfd))
   {
-    fd_set readfds, writefds;
-    FD_ZERO(&readfds);
-    FD_ZERO(&writefds);
+    log_perror(LOG_LEVEL_ERROR, "epoll_ctl()");
+    exit(1);
+  }
 
-    int highfd = 0;
+  list *ready    = list_new(16);  // Connections with input completed by io_uring
+  list *accepted = list_new(LISTENER_ACCEPT_BUDGET);  // Connections just accepted
 
-    // Mark fds to watch
-    highfd = listener_mark_fds(l, highfd, &readfds, &writefds);
-    highfd = connectionbundle_mark_fds(cb, highfd, &readfds, &writefds);
+  sig_atomic_t seen_stats_generation = stats_generation;
 
-    struct timeval timeout = {30, 0};  // Thirty seconds
+  // Watch the listening socket for new connections
+  if (!listener_watch(l, cb->epollfd))
+  {
+    log_printf(LOG_LEVEL_ERROR, "Couldn't watch listening socket: %s\n", strerror(l->lasterrno));
+    exit(1);
+  }
+
+  struct epoll_event events[LOOP_EVENT_BATCH_SIZE];
+
+  bool done = false;
+
+  while (!done)
+  {
+    // Sleep until the next timer is due. Don't sleep while messages for other
+    //  shards or operations for io_uring are still held back, or while
+    //  connections have buffered input left to handle.
+    int timeout = timerwheel_get_timeout(s->timers, loopclock_refresh());
+    if ((shard_has_backlog(s) || (u && uring_has_backlog(u))) && ((timeout < 0) || (timeout > 1)))
+      timeout = 1;
+    if (connectionbundle_get_deferred_count(cb) > 0)
+      timeout = 0;
 
     // Wait for activity on fds
-    int count = select(highfd + 1, &readfds, &writefds, NULL, &timeout);
-    log_printf(LOG_LEVEL_DEBUG, "Select returned: %d\n", count);
+    int count = epoll_wait(cb->epollfd, events, LOOP_EVENT_BATCH_SIZE, timeout);
+    log_printf(LOG_LEVEL_DEBUG, "epoll_wait returned: %d\n", count);
 
-    // Give up if the select() didn't work
+    // Give up if the epoll_wait() didn't work
     if (count < 0)
     {
-      log_perror(LOG_LEVEL_DEBUG, "select()");
+      if (errno == EINTR)
+        continue;
+
+      log_perror(LOG_LEVEL_DEBUG, "epoll_wait()");
       exit(1);
     }
 
-    // If nothing happened, keep waiting
-    if (count == 0)
-      continue;
+    // Take the time once for this round; everything handled in it is
+    //  timestamped from the cached reading. Then fire timers that have come
+    //  due, which also brings the wheel's time up to date for timers
+    //  scheduled while handling this round's events.
+    timerwheel_advance(s->timers, loopclock_refresh());
 
-    // Check for new connections
-    connection *c = listener_accept_connection(l, &readfds);
-    if (c != NULL)
+    // Only the ready fds are visited
+    for (int i = 0; i < count; i++)
     {
-      log_printf(LOG_LEVEL_INFO, "New connection %p accepted.\n", c);
-      connectionbundle_add_connection(cb, c);
+      if (events[i].data.ptr == l)
+      {
+        // Drain new connections, up to the budget
+        listener_accept_connections(l, accepted, LISTENER_ACCEPT_BUDGET);
+
+        connection *c;
+        while ((c = list_shift(accepted)))
+        {
+          log_printf(LOG_LEVEL_INFO, "New connection %p accepted on shard %d.\n", c, s->id);
+          c->shard = s;
+          connectionbundle_add_connection(cb, c);
+          connection_start_timers(c);
+        }
+        continue;
+      }
+      else if (u && (events[i].data.ptr == u))
+      {
+        // Completions are waiting
+        uring_process_completions(u, ready);
+
+        connection *c;
+        while ((c = list_shift(ready)))
+        {
+          if (c->status != CONNECTION_STATUS_CLOSED)
+            handle_connection(c);
+        }
+        continue;
+      }
+      else if (events[i].data.ptr == s)
+      {
+        // Other shards have posted messages
+        shard_process_messages(s);
+        continue;
+      }
+
+      // Activity on an existing connection. A connection closed earlier in
+      //  this batch may have had its fd number reused already, so skip it.
+      connection *c = events[i].data.ptr;
+      if (c->status != CONNECTION_STATUS_CLOSED)
+        handle_connection(c);
     }
 
-    // Check for activity on existing connections
+    // Carry on with connections that ran out of frame budget last round.
+    //  Any that run out again wait for the next round, behind the others.
+    int deferred = connectionbundle_get_deferred_count(cb);
+    while (deferred-- > 0)
+    {
+      connection *c = connectionbundle_get_next_deferred_connection(cb);
+      if (c->status != CONNECTION_STATUS_CLOSED)
+        handle_connection_buffered(c, 0);
+    }
+
+    // Push out output for every connection touched this round, including
+    //  deliveries from other shards and queue pumps, rather than waiting
+    //  for another round to find the socket writable. With io_uring, all of
+    //  this round's operations are then submitted at once.
     cb_iter iter = connectionbundle_iter_new(cb);
-    while ((c = connectionbundle_get_next_active_connection(cb, &iter, &readfds, &writefds)))
+    connection *touched;
+    while ((touched = connectionbundle_get_next_touched_connection(cb, &iter)))
     {
-      handle_connection(c);
+      if ((touched->status != CONNECTION_STATUS_CONNECTED) && (touched->status != CONNECTION_STATUS_STOMP_ERROR))
+        continue;
+      else if (!connection_has_pending_output(touched))
+        continue;  // Nothing to write
+
+      handle_connection_output(touched);
+      connection_flush_output(touched);
     }
 
+    if (u)
+      uring_submit(u);
+
+    // Hand over this round's messages to other shards
+    shard_flush(s);
+
+    // Toggle interest for connections whose pending output changed
+    connectionbundle_update_interest(cb);
+
     // Check for closed connections
-    iter = connectionbundle_iter_new(cb);
-    while ((c = connectionbundle_reap_next_connection(cb, &iter)))
+    connection *c;
+    while ((c = connectionbundle_reap_next_connection(cb)))
     {
       reap_connection(c);
     }
+
+    // Dump stats if they were asked for since the last round
+    if (seen_stats_generation != stats_generation)
+    {
+      seen_stats_generation = stats_generation;
+      listener_dump_stats(l);
+      connectionbundle_dump_stats(cb);
+    }
   }
 }
 
+// SIGUSR1 handler. Each shard notices the new generation and dumps its own
+//  stats; shards are woken so that idle ones don't wait out their timeout.
+void handle_stats_signal(int signum)
+{
+  (void)signum;
+
+  stats_generation++;
+  shard_wake_all();
+}
+
 void handle_connection(connection *c)
 {
   log_printf(LOG_LEVEL_DEBUG, "Connection %p is interesting.\n", c);
-  connection_dump(c);
+  log_dump(LOG_LEVEL_DEBUG, connection_dump(c));
+
+  // Connections with input left over are handled by the deferred pass, and
+  //  new data stays in the socket until the earlier input is dealt with
+  if (c->deferred)
+    return;
+
+  size_t readcount = connection_pump_input(c, NETWORK_READ_BUDGET);
 
-  connection_pump_input(c);
+  handle_connection_buffered(c, readcount);
+}
 
+// Handles input already read into the connection's buffer, and pushes out
+//  any resulting output. 'readcount' is how much of this round's read budget
+//  has been used already.
+void handle_connection_buffered(connection *c, size_t readcount)
+{
   if ((c->status == CONNECTION_STATUS_LOGIN) || (c->status == CONNECTION_STATUS_CONNECTED))
-    handle_connection_input(c);
+    handle_connection_input(c, readcount);
 
   if ((c->status == CONNECTION_STATUS_CONNECTED) || (c->status == CONNECTION_STATUS_STOMP_ERROR))
     handle_connection_output(c);
 
   connection_pump_output(c);
+
+  connection_touch(c);
 }
 
-void handle_connection_input(connection *c)
+void handle_connection_input(connection *c, size_t readcount)
 {
-  frameparser_outcome outcome = frameparser_parse(c->frameparser, c->inbuffer);
-  log_printf(LOG_LEVEL_DEBUG, "Parse: %d\n", outcome);
-
-  if (outcome == FP_OUTCOME_ERROR)
+  // Handle every complete frame that is already buffered, up to a budget so
+  //  that one busy producer can't hold up the rest of the bundle
+  int n = 0;
+  while (n < LOOP_INPUT_FRAME_BUDGET)
   {
-    log_printf(LOG_LEVEL_ERROR, "-- Parse error: ");
-    bytestring_dump(frameparser_get_error(c->frameparser));
-    connection_send_error_message(c, NULL, bytestring_dup(frameparser_get_error(c->frameparser)));
+    // An earlier frame may have ended the session
+    if ((c->status != CONNECTION_STATUS_LOGIN) && (c->status != CONNECTION_STATUS_CONNECTED))
+      return;
+
+    frameparser_outcome outcome = frameparser_parse(c->frameparser, c->inbuffer);
+    log_printf(LOG_LEVEL_DEBUG, "Parse: %d\n", outcome);
+
+    if (outcome == FP_OUTCOME_ERROR)
+    {
+      const bytestring *error = frameparser_get_error(c->frameparser);
+      log_printf(LOG_LEVEL_ERROR, "-- Parse error: %.*s\n", (int) bytestring_get_length(error), (const char *) bytestring_get_bytes(error));
+      connection_send_error_message(c, NULL, bytestring_dup(frameparser_get_error(c->frameparser)));
+      return;
+    }
+    else if (outcome == FP_OUTCOME_WAITING)
+    {
+      // The rest of a content-length body can be read straight into its
+      //  frame, now that the buffered input has been parsed up to it. Those
+      //  reads share this round's read budget with the ones before them.
+      if (readcount >= NETWORK_READ_BUDGET)
+        break;
+
+      size_t bodycount = connection_pump_body(c, NETWORK_READ_BUDGET - readcount);
+      if (bodycount > 0)
+      {
+        readcount += bodycount;
+        continue;
+      }
+
+      return;  // Need more data
+    }
+
+    // Take every frame finished so far, and process them together
+    frame *frames[FP_FRAME_QUEUE_SIZE];
+    int count = frameparser_get_frames(c->frameparser, frames, FP_FRAME_QUEUE_SIZE);
+    n += count;
+
+    handle_connection_input_frames(c, frames, count);
   }
-  else if (outcome == FP_OUTCOME_FRAME)
+
+  // Out of budget; pick up the rest next round
+  connectionbundle_defer_connection(c->bundle, c);
+}
+
+// Processes a run of frames in the order they arrived.
+void handle_connection_input_frames(connection *c, frame **frames, int count)
+{
+  for (int i = 0; i < count; i++)
   {
-    frame *f = frameparser_get_frame(c->frameparser);
     log_printf(LOG_LEVEL_DEBUG, "-- Completed frame: ");
-    frame_dump(f);
+    log_dump(LOG_LEVEL_DEBUG, frame_dump(frames[i]));
 
-    // Process the frame
-    handle_connection_input_frame(c, f);
+    if (c->status == CONNECTION_STATUS_CONNECTED)
+    {
+      // The rest all go to the test queue, so hand them over together
+      shard_enqueue_batch(q, frames + i, count - i);
+      return;
+    }
+    else if (c->status == CONNECTION_STATUS_LOGIN)
+      handle_connection_input_frame(c, frames[i]);
+    else
+      frame_free(frames[i]);  // An earlier frame ended the session
   }
-
 }
 
 void handle_connection_input_frame(connection *c, frame *f)
@@ -158,13 +467,35 @@ void handle_connection_input_frame(connection *c, frame *f)
   {
     if ((f->command == CMD_STOMP) || (f->command == CMD_CONNECT))
     {
+      // Agree on heartbeats, if the client asked for them
+      const bytestring *heartbeat = headerbundle_get_header_value_by_atom(frame_get_headerbundle(f), HDR_HEART_BEAT);
+      if (heartbeat && !connection_negotiate_heartbeat(c, heartbeat))
+      {
+        connection_send_error_message(c, f, bytestring_new_from_string("Malformed heart-beat header"));
+        return;
+      }
+
+      // The client may say how its output should be grouped into writes
+      const bytestring *coalesce = headerbundle_get_header_value_by_str(frame_get_headerbundle(f), "coalesce");
+      if (coalesce && !connection_negotiate_coalesce(c, coalesce))
+      {
+        connection_send_error_message(c, f, bytestring_new_from_string("Unknown coalesce mode"));
+        return;
+      }
+
       frame *f = frame_new();
       frame_set_command(f, CMD_CONNECTED);
       headerbundle *hb = frame_get_headerbundle(f);
       headerbundle_append_header(hb, bytestring_new_from_string("version"), bytestring_new_from_string("1.2"));
-      if (!frameserializer_enqueue_frame(c->frameserializer, f))
+      bytestring *hbvalue = bytestring_new(16);
+      bytestring_printf(hbvalue, "%d,%d", LIMIT_HEARTBEAT_FREQ_MIN, DEFAULT_HEARTBEAT_FREQ);
+      headerbundle_append_header(hb, bytestring_new_from_string("heart-beat"), hbvalue);
+
+      if (!frameserializer_enqueue_frame(c->frameserializer, f, NULL))
         abort();  // Couldn't enqueue CONNECTED frame
+      frame_free(f);  // The serializer holds it now
       c->status = CONNECTION_STATUS_CONNECTED;
+      connection_start_heartbeats(c);
     }
     else
     {
@@ -175,10 +506,10 @@ void handle_connection_input_frame(connection *c, frame *f)
   else
   {
     //// Echo frame back to client
-    //frameserializer_enqueue_frame(c->frameserializer, f);
+    //frameserializer_enqueue_frame(c->frameserializer, f, NULL);
 
-    // Add frame to test queue
-    queue_enqueue(q, f);
+    // Add frame to test queue, on its home shard
+    shard_enqueue(q, f);
   }
 }
 
@@ -186,7 +517,14 @@ void handle_connection_output(connection *c)
 {
   frameserializer_serialize(c->frameserializer, c->outbuffer);
 
-
+  // Clear out completed frames, so the serializer can keep finishing new ones,
+  //  dropping the references their work items held
+  fs_completed_item item;
+  while (frameserializer_get_completed_frame(c->frameserializer, &item))
+  {
+    frame_free(item.frame);
+    c->frames_out++;
+  }
 }
 
 void reap_connection(connection *c)
@@ -198,46 +536,3 @@ void reap_connection(connection *c)
 
   connection_free(c);
 }
-
-void parse_file(char *filename)
-{
-  int fd = open(filename, O_RDONLY);
-  if (fd < 0)
-  {
-    log_perror(LOG_LEVEL_ERROR, "open()");
-    exit(1);
-  }
-
-  frameparser *fp = frameparser_new();
-
-  buffer *b = buffer_new(4096);
-
-  while (buffer_input_fd(b, fd, 4096) > 0)
-  {
-    log_printf(LOG_LEVEL_DEBUG, "Read loop...\n");
-
-    frameparser_outcome outcome = frameparser_parse(fp, b);
-    log_printf(LOG_LEVEL_DEBUG, "Parse: %d\n", outcome);
-
-    if (outcome == FP_OUTCOME_ERROR)
-    {
-      log_printf(LOG_LEVEL_ERROR, "-- Parse error: ");
-      bytestring_dump(frameparser_get_error(fp));
-      break;
-    }
-    else if (outcome == FP_OUTCOME_FRAME)
-    {
-      frame *f = frameparser_get_frame(fp);
-      log_printf(LOG_LEVEL_INFO, "-- Completed frame: ");
-      frame_dump(f);
-      frame_free(f);
-    }
-  }
-
-  close(fd);
-
-  buffer_dump(b);
-
-  buffer_free(b);
-  frameparser_free(fp);
-}
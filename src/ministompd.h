@@ -5,6 +5,8 @@ typedef uint64_t queue_local_id;  // The id of a specific frame within a queue
 
 #include "alloc.h"
 #include "log.h"
+#include "loopclock.h"
+#include "bytescan.h"
 #include "buffer.h"
 #include "bytestring.h"
 #include "hash.h"
@@ -13,7 +15,9 @@ typedef uint64_t queue_local_id;  // The id of a specific frame within a queue
 #include "frameparser.h"
 #include "frameserializer.h"
 #include "headerbundle.h"
+#include "timerwheel.h"
 #include "connection.h"
+#include "uring.h"
 #include "connectionbundle.h"
 #include "listener.h"
 #include "queueconfig.h"
@@ -21,6 +25,7 @@ typedef uint64_t queue_local_id;  // The id of a specific frame within a queue
 #include "queue.h"
 #include "subscription.h"
 #include "framerouter.h"
+#include "shard.h"
 
 #define LIMIT_FRAME_CMD_LINE_LEN      32
 #define LIMIT_FRAME_HEADER_LINE_LEN   8192
@@ -29,8 +34,30 @@ typedef uint64_t queue_local_id;  // The id of a specific frame within a queue
 
 #define LIMIT_HEARTBEAT_FREQ_MIN      10000  // 10 seconds
 #define DEFAULT_HEARTBEAT_FREQ        30000  // 30 seconds
+#define HEARTBEAT_MISS_GRACE          5000   // Allowance for network delays before a missed heartbeat
+#define LIMIT_LOGIN_TIMEOUT           30000  // 30 seconds from accept to CONNECT
 
 #define DEFAULT_QUEUE_SIZE_MAX        1024   // 1024 frames
 #define DEFAULT_QUEUE_NACK_MAX        20     // 20 nacks
+#define DEFAULT_QUEUE_ACK_TIMEOUT     60000  // 60 seconds before an unacknowledged frame is redelivered
 
-#define NETWORK_READ_SIZE             4096   // Read in 4KiB chunks
+#define NETWORK_READ_SIZE             4096   // Read in 4KiB chunks, to start with
+#define NETWORK_READ_SIZE_MAX         (1024 * 1024)      // Largest chunk a busy connection grows to
+#define NETWORK_READ_LOOP_MAX         16     // Max reads per connection per wakeup
+#define NETWORK_READ_BUDGET           (4 * 1024 * 1024)  // Max bytes read per connection per wakeup
+
+#define LOOP_EVENT_BATCH_SIZE         256    // Max events handled per epoll_wait()
+#define LOOP_INPUT_FRAME_BUDGET       64     // Max frames handled per connection per round
+
+#define DEFAULT_OUTPUT_HIGH_WATER     (1024 * 1024)  // Stop deliveries to a connection with this much output pending
+#define DEFAULT_OUTPUT_LOW_WATER      (256 * 1024)   // Resume deliveries once its output drains to this
+#define DEFAULT_QUEUED_HIGH_WATER     12     // Likewise, for frames waiting to be serialized
+#define DEFAULT_QUEUED_LOW_WATER      4
+#define DEFAULT_QUEUED_MAX            256    // Refuse deliveries, handing them back to the queue, beyond this
+
+#define COALESCE_FLUSH_BYTES          (64 * 1024)  // Throughput-mode output is written early once this much builds up
+
+#define DEFAULT_LISTEN_BACKLOG        4096   // Pending connections queued by the kernel
+#define LISTENER_ACCEPT_BUDGET        64     // Max connections accepted per wakeup
+#define LISTENER_RETRY_MIN            50     // Milliseconds to stop accepting after running out of fds or memory
+#define LISTENER_RETRY_MAX            2000   // Longest pause, while resources stay short
@@ -1,5 +1,35 @@
 #include "ministompd.h"
 
+// Arms the expiry timer for when the oldest stored frame reaches the age
+//  limit. Runs on the queue's home shard.
+static void queue_schedule_expiry(queue *q)
+{
+  uint64_t oldest;
+  if (!storage_get_oldest_time(q->storage, &oldest))
+    return;  // Nothing stored
+
+  timerwheel_schedule(shard_self()->timers, &q->expiry_timer, oldest + ((uint64_t) q->config->age_max * 1000));
+}
+
+// Retires frames that have been stored for longer than the age limit. They
+//  are dropped, whatever the queue's nack_action.
+static void queue_expire(timer *t, void *data)
+{
+  queue *q = data;
+
+  // Frames stored at or before this time are past the limit
+  uint64_t age = (uint64_t) q->config->age_max * 1000;
+  uint64_t now = loopclock_now_ms();
+  if (now < age)
+    return;
+
+  int count = storage_expire(q->storage, now - age + 1);
+  if (count > 0)
+    log_printf(LOG_LEVEL_INFO, "Retired %d frames past their age limit from queue %p.\n", count, q);
+
+  queue_schedule_expiry(q);
+}
+
 // Creates a new queue. Takes ownership of queue name, but not config.
 queue *queue_new(bytestring *name, const queueconfig *config)
 {
@@ -7,14 +37,21 @@ queue *queue_new(bytestring *name, const queueconfig *config)
 
   q->name        = name;
   q->storage     = storage_new(config->storage_type, q);
-  q->framerouter = framerouter_new();
+  q->framerouter = framerouter_new(config->distribution);
   q->config      = config;
+  q->home_shard  = 0;
+
+  timer_init(&q->expiry_timer, queue_expire, q);
 
   return q;
 }
 
 void queue_free(queue *q)
 {
+  shard *s = shard_get(q->home_shard);
+  if (s->timers)
+    timerwheel_cancel(s->timers, &q->expiry_timer);
+
   bytestring_free(q->name);
   storage_free(q->storage);
   framerouter_free(q->framerouter);
@@ -22,7 +59,31 @@ void queue_free(queue *q)
   xfree(q);
 }
 
+// Adds a frame to the queue, taking ownership of it. Returns false if the
+//  queue is full, in which case the frame is dropped.
 bool queue_enqueue(queue *q, frame *f)
 {
-  return storage_enqueue(q->storage, f);
+  return (queue_enqueue_batch(q, &f, 1) == 1);
+}
+
+// Adds a run of frames to the queue in one go, taking ownership of them.
+//  Returns the number added, which is less than count if the queue filled
+//  up. The frames that didn't fit are dropped.
+int queue_enqueue_batch(queue *q, frame **frames, int count)
+{
+  int added = 0;
+  while ((added < count) && storage_enqueue(q->storage, frames[added]))
+    added++;
+
+  if (added < count)
+  {
+    log_printf(LOG_LEVEL_ERROR, "Queue %p is full; dropped %d frames.\n", q, count - added);
+    for (int i = added; i < count; i++)
+      frame_free(frames[i]);
+  }
+
+  if ((added > 0) && (q->config->age_max > 0) && !q->expiry_timer.pending)
+    queue_schedule_expiry(q);
+
+  return added;
 }
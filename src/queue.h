@@ -7,5 +7,6 @@
 queue *queue_new(bytestring *name, const queueconfig *config);
 void   queue_free(queue *q);
 bool   queue_enqueue(queue *q, frame *f);
+int    queue_enqueue_batch(queue *q, frame **frames, int count);
 
 #endif
@@ -18,6 +18,10 @@ queueconfig *queueconfig_new(void)
   qc->nack_max      = DEFAULT_QUEUE_NACK_MAX;
   qc->nack_action   = QC_REJECT_DROP;
 
+  qc->ack_timeout   = DEFAULT_QUEUE_ACK_TIMEOUT;
+
+  qc->coalesce      = QC_COALESCE_ANY;
+
   return qc;
 }
 
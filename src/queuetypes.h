@@ -1,5 +1,8 @@
 #include <time.h>  // struct timespec
 
+#include "timerwheel.h"
+#include "list.h"
+
 #ifndef MINISTOMPD_TYPES_H
 #define MINISTOMPD_TYPES_H
 
@@ -28,6 +31,8 @@ struct queue
   storage           *storage;
   framerouter       *framerouter;
   const queueconfig *config;
+  int                home_shard;  // Shard owning this queue's storage and router
+  timer              expiry_timer;  // Due when the oldest stored frame reaches age_max
 };
 
 // *** Storage ***
@@ -67,6 +72,13 @@ typedef enum
   QC_FULL_DROP_NEWEST
 } qc_full_action;
 
+typedef enum
+{
+  QC_COALESCE_ANY,        // No preference; connections keep their own
+  QC_COALESCE_LATENCY,    // Subscribers' output is written as soon as it is serialized
+  QC_COALESCE_THROUGHPUT  // Subscribers' output is coalesced into fewer, fuller writes
+} qc_coalesce;
+
 typedef enum
 {
   QC_REJECT_DROP,
@@ -83,21 +95,30 @@ struct queueconfig
   int              size_max;
   qc_full_action   full_action;
 
-  int              age_max;
+  int              age_max;  // Seconds a frame may stay stored, or 0 for no limit
   qc_reject_action retire_action;
 
   int              nack_max;
   qc_reject_action nack_action;
+
+  int              ack_timeout;  // Milliseconds to wait for an ACK before redelivering, or 0 to wait forever
+
+  qc_coalesce      coalesce;  // Output coalescing for subscribers' connections, unless they chose their own
 };
 
 // *** Framerouter ***
 
 struct framerouter
 {
+  qc_distribution distribution;  // Whether each frame goes to one subscription or all of them
+
   list *subscriptions;
   int   subscription_index;  // Index of slot of next subscription to route to
 
-  list *dispatches;
+  list *dispatches;  // Dispatches in the order their frames were stored
+  list *waiting;  // Dispatches not yet delivered, for lack of an unthrottled subscription
+  list *held;     // Subscriptions with dispatches held back for them alone, for broadcast queues
+  bool  pumping;  // Delivering waiting dispatches, which deliveries handed straight back must not re-enter
 };
 
 // *** Subscription ***
@@ -120,6 +141,8 @@ struct subscription
   sub_ack_type       ack_type;
   hash              *deliveries;  // Deliveries on this subscription keyed by message-id
   uint64_t           next_seqnum;
+  list              *held;     // Broadcast dispatches held back until the connection drains, or given back; used by the queue's router only
+  bool               holding;  // On the router's list of subscriptions with dispatches held back
 //  queue_local_id last_qlid;  // The qlid of the most recent frame consumed by this subscription
 };
 
@@ -128,9 +151,11 @@ struct subscription
 
 struct dispatch
 {
-  frame          *frame;
+  frame          *frame;  // NULL once forgotten, if still waiting or held back
   storage_handle  handle;
   struct timespec createtime;  // The time the dispatch item was created
+  int             holds;  // Count of subscriptions it is held back for, on broadcast queues
+  bool            waiting;  // On the router's list of waiting dispatches
 };
 
 // -- Delivery --
@@ -146,12 +171,15 @@ typedef enum
 
 struct delivery
 {
+  subscription   *sub;
   frame          *frame;
+  const bytestring *msgid;  // The frame's message-id, keying the delivery on its subscription
   uint64_t        seqnum;  // Sequence number within subscription
   delivery_status status;
   struct timespec createtime;  // The time the delivery item was created
   struct timespec writetime;  // If status is not DEL_STATUS_WRITE, the time it was written to the client
   struct timespec completetime;  // If status is not DEL_STATUS_WRITE or DEL_STATUS_WAIT, the time of the ACK or NACK
+  timer           timer;  // Redelivery timeout, if the subscription needs ACKs
 };
 
 #endif
@@ -0,0 +1,332 @@
+#include <errno.h>
+#include <assert.h>  // assert()
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+
+#include "ministompd.h"
+
+static shard **shards      = NULL;
+static int     shard_count = 0;
+
+static __thread shard *current = NULL;  // Shard owning the calling thread
+
+static shard *shard_new(int id, int count)
+{
+  shard *s = xmalloc(sizeof(shard));
+
+  s->id       = id;
+  s->run      = NULL;
+  s->listener = NULL;
+  s->bundle   = NULL;
+  s->inbound  = xmalloc(sizeof(spscring *) * count);
+  s->backlog  = xmalloc(sizeof(list *) * count);
+  s->wake     = xmalloc(sizeof(bool) * count);
+  s->timers   = NULL;
+
+  for (int i = 0; i < count; i++)
+  {
+    // A shard never posts to itself, so it needs no ring from itself
+    s->inbound[i] = (i == id) ? NULL : spscring_new(SHARD_RING_SIZE, sizeof(struct shard_msg));
+    s->backlog[i] = list_new(4);
+    s->wake[i]    = false;
+  }
+
+  s->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (s->eventfd == -1)
+  {
+    log_perror(LOG_LEVEL_ERROR, "eventfd()");
+    exit(1);
+  }
+
+  return s;
+}
+
+// Creates the given number of shards. Must be called once, before any shard
+//  threads are started.
+bool shard_setup(int count)
+{
+  if ((count < 1) || (count > SHARD_COUNT_MAX))
+    return false;
+
+  shards = xmalloc(sizeof(shard *) * count);
+  for (int i = 0; i < count; i++)
+    shards[i] = shard_new(i, count);
+
+  shard_count = count;
+
+  return true;
+}
+
+int shard_get_count(void)
+{
+  return shard_count;
+}
+
+shard *shard_get(int id)
+{
+  return shards[id];
+}
+
+// Returns the shard whose event loop is running on the calling thread.
+shard *shard_self(void)
+{
+  return current;
+}
+
+// Binds the calling thread to the given shard, and registers the shard's
+//  eventfd with the shard's bundle. Called at the top of the event loop.
+void shard_enter(shard *s)
+{
+  current = s;
+
+  struct epoll_event ev;
+  ev.events   = EPOLLIN;
+  ev.data.ptr = s;
+  if (epoll_ctl(s->bundle->epollfd, EPOLL_CTL_ADD, s->eventfd, &ev) == -1)
+  {
+    log_perror(LOG_LEVEL_ERROR, "epoll_ctl()");
+    exit(1);
+  }
+}
+
+static void *shard_thread_main(void *arg)
+{
+  shard *s = arg;
+  s->run(s);
+  return NULL;
+}
+
+// Starts the shard's event loop on a new thread.
+bool shard_start(shard *s, shard_func_run *run)
+{
+  s->run = run;
+
+  int error = pthread_create(&s->thread, NULL, shard_thread_main, s);
+  if (error)
+  {
+    errno = error;
+    return false;
+  }
+
+  return true;
+}
+
+void shard_join(shard *s)
+{
+  pthread_join(s->thread, NULL);
+}
+
+// Picks the home shard of a queue from its name. This must be stable for
+//  the life of the process, so it uses FNV-1a rather than the keyed hash.
+int shard_home_for_queue(const bytestring *name)
+{
+  uint32_t h = 2166136261UL;
+
+  size_t len = bytestring_get_length(name);
+  const uint8_t *bytes = bytestring_get_bytes(name);
+  for (size_t i = 0; i < len; i++)
+  {
+    h ^= bytes[i];
+    h *= 16777619UL;
+  }
+
+  return h % shard_count;
+}
+
+// Posts a message from the calling thread's shard to another shard. The
+//  destination is woken by shard_flush() at the end of the current tick.
+void shard_post(shard *to, const struct shard_msg *msg)
+{
+  shard *from = current;
+  assert(from != to);
+
+  // Preserve ordering behind anything already backlogged
+  if ((list_get_length(from->backlog[to->id]) > 0) || !spscring_push(to->inbound[from->id], msg))
+  {
+    struct shard_msg *copy = xmalloc(sizeof(struct shard_msg));
+    *copy = *msg;
+    list_push(from->backlog[to->id], copy);
+  }
+
+  from->wake[to->id] = true;
+}
+
+// Adds a frame to a queue, handing it over to the queue's home shard if
+//  that is not the calling thread's shard.
+void shard_enqueue(queue *q, frame *f)
+{
+  if (q->home_shard == current->id)
+  {
+    queue_enqueue(q, f);
+    return;
+  }
+
+  struct shard_msg msg = {.type = SHARD_MSG_ENQUEUE, .queue = q, .sub = NULL, .frame = f};
+  shard_post(shards[q->home_shard], &msg);
+}
+
+// Adds a run of frames to a queue, handing them over to the queue's home
+//  shard if that is not the calling thread's shard.
+void shard_enqueue_batch(queue *q, frame **frames, int count)
+{
+  if (q->home_shard == current->id)
+  {
+    queue_enqueue_batch(q, frames, count);
+    return;
+  }
+
+  // Each message carries one frame, but the home shard is only woken once
+  //  for all of them, by shard_flush()
+  for (int i = 0; i < count; i++)
+  {
+    struct shard_msg msg = {.type = SHARD_MSG_ENQUEUE, .queue = q, .sub = NULL, .frame = frames[i]};
+    shard_post(shards[q->home_shard], &msg);
+  }
+}
+
+// Delivers a frame on a subscription, handing it over to the shard owning
+//  the subscription's connection if that is not the calling thread's shard.
+//  The delivery gets its own reference to the frame, so the frame outlives
+//  its time in storage for as long as the delivery needs it.
+void shard_deliver(subscription *sub, frame *f)
+{
+  frame_ref(f);
+
+  shard *to = sub->connection->shard;
+  if (to == current)
+  {
+    subscription_deliver(sub, f);
+    return;
+  }
+
+  struct shard_msg msg = {.type = SHARD_MSG_DELIVER, .queue = NULL, .sub = sub, .frame = f};
+  shard_post(to, &msg);
+}
+
+// Resumes routing on a queue, on its home shard.
+void shard_pump_queue(queue *q)
+{
+  if (q->home_shard == current->id)
+  {
+    framerouter_pump(q->framerouter);
+    return;
+  }
+
+  struct shard_msg msg = {.type = SHARD_MSG_PUMP, .queue = q, .sub = NULL, .frame = NULL};
+  shard_post(shards[q->home_shard], &msg);
+}
+
+// Hands a frame a subscription gave up on back to the router of the
+//  subscription's queue, on the queue's home shard, along with the caller's
+//  reference to it. Used both when the subscription's connection had no room
+//  for the frame and when its client didn't acknowledge it in time.
+void shard_redispatch(subscription *sub, frame *f)
+{
+  queue *q = sub->queue;
+  if (q->home_shard == current->id)
+  {
+    framerouter_redispatch(q->framerouter, sub, f);
+    return;
+  }
+
+  struct shard_msg msg = {.type = SHARD_MSG_REDISPATCH, .queue = q, .sub = sub, .frame = f};
+  shard_post(shards[q->home_shard], &msg);
+}
+
+// Carries out every message posted to this shard by the other shards.
+void shard_process_messages(shard *s)
+{
+  // Reset the wakeup counter
+  uint64_t count;
+  if ((read(s->eventfd, &count, sizeof(count)) < 0) && (errno != EAGAIN))
+  {
+    log_perror(LOG_LEVEL_ERROR, "read()");
+    exit(1);
+  }
+
+  for (int i = 0; i < shard_count; i++)
+  {
+    if (i == s->id)
+      continue;
+
+    struct shard_msg msg;
+    while (spscring_pop(s->inbound[i], &msg))
+    {
+      switch (msg.type)
+      {
+      case SHARD_MSG_ENQUEUE:
+        queue_enqueue(msg.queue, msg.frame);
+        break;
+      case SHARD_MSG_DELIVER:
+        subscription_deliver(msg.sub, msg.frame);
+        break;
+      case SHARD_MSG_PUMP:
+        framerouter_pump(msg.queue->framerouter);
+        break;
+      case SHARD_MSG_REDISPATCH:
+        framerouter_redispatch(msg.queue->framerouter, msg.sub, msg.frame);
+        break;
+      }
+    }
+  }
+}
+
+// Moves backlogged messages into the rings where there is room, then signals
+//  each shard that was posted to during this tick. One eventfd write per
+//  destination covers any number of messages.
+void shard_flush(shard *s)
+{
+  for (int i = 0; i < shard_count; i++)
+  {
+    if (i == s->id)
+      continue;
+
+    list *backlog = s->backlog[i];
+    while (list_get_length(backlog) > 0)
+    {
+      struct shard_msg *msg = list_get_item(backlog, 0);
+      if (!spscring_push(shards[i]->inbound[s->id], msg))
+        break;  // Still full
+
+      list_shift(backlog);
+      xfree(msg);
+      s->wake[i] = true;
+    }
+
+    if (s->wake[i])
+    {
+      uint64_t one = 1;
+      if (write(shards[i]->eventfd, &one, sizeof(one)) < 0)
+      {
+        log_perror(LOG_LEVEL_ERROR, "write()");
+        exit(1);
+      }
+
+      s->wake[i] = false;
+    }
+  }
+}
+
+// Returns true iff this shard is holding messages that still need to be
+//  moved into another shard's ring.
+bool shard_has_backlog(shard *s)
+{
+  for (int i = 0; i < shard_count; i++)
+  {
+    if (list_get_length(s->backlog[i]) > 0)
+      return true;
+  }
+
+  return false;
+}
+
+// Wakes every shard's event loop. Only uses write(), so it is safe to call
+//  from a signal handler.
+void shard_wake_all(void)
+{
+  for (int i = 0; i < shard_count; i++)
+  {
+    uint64_t one = 1;
+    (void)!write(shards[i]->eventfd, &one, sizeof(one));
+  }
+}
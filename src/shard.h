@@ -0,0 +1,68 @@
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "queuetypes.h"
+#include "spscring.h"
+
+#ifndef MINISTOMPD_SHARD_H
+#define MINISTOMPD_SHARD_H
+
+#define SHARD_COUNT_MAX 64
+#define SHARD_RING_SIZE 4096  // Messages in flight between each pair of shards
+
+typedef enum
+{
+  SHARD_MSG_ENQUEUE,  // Add a frame to a queue owned by the receiving shard
+  SHARD_MSG_DELIVER,  // Deliver a frame on a subscription whose connection lives on the receiving shard
+  SHARD_MSG_PUMP,      // Resume routing on a queue owned by the receiving shard
+  SHARD_MSG_REDISPATCH  // Take back a frame a subscription gave up on, for lack of room or of an ACK
+} shard_msg_type;
+
+struct shard_msg
+{
+  shard_msg_type type;
+  queue         *queue;  // For SHARD_MSG_ENQUEUE, SHARD_MSG_PUMP and SHARD_MSG_REDISPATCH
+  subscription  *sub;    // For SHARD_MSG_DELIVER and SHARD_MSG_REDISPATCH
+  frame         *frame;
+};
+
+// A shard is one reactor thread with its own listening socket, connections
+//  and event loop. Queues are owned by a home shard; traffic for a queue or
+//  connection living elsewhere is posted to its shard over an SPSC ring.
+struct shard;
+typedef void shard_func_run(struct shard *s);
+
+typedef struct shard
+{
+  int                      id;        // Index of this shard
+  pthread_t                thread;    // Thread running the shard's event loop
+  shard_func_run          *run;       // Event loop entry point
+  listener                *listener;  // Listening socket, sharing the address through SO_REUSEPORT
+  struct connectionbundle *bundle;    // Connections accepted by this shard
+  int                      eventfd;   // Signalled when messages are posted to this shard
+  spscring               **inbound;   // Incoming rings, indexed by producing shard
+  list                   **backlog;   // Outgoing messages that did not fit in each destination's ring
+  bool                    *wake;      // Destinations to signal at the end of the current tick
+  timerwheel              *timers;    // Timers run by the shard's event loop
+} shard;
+
+bool   shard_setup(int count);
+int    shard_get_count(void);
+shard *shard_get(int id);
+shard *shard_self(void);
+void   shard_enter(shard *s);
+bool   shard_start(shard *s, shard_func_run *run);
+void   shard_join(shard *s);
+int    shard_home_for_queue(const bytestring *name);
+void   shard_post(shard *to, const struct shard_msg *msg);
+void   shard_enqueue(queue *q, frame *f);
+void   shard_enqueue_batch(queue *q, frame **frames, int count);
+void   shard_deliver(subscription *sub, frame *f);
+void   shard_pump_queue(queue *q);
+void   shard_redispatch(subscription *sub, frame *f);
+void   shard_process_messages(shard *s);
+void   shard_flush(shard *s);
+bool   shard_has_backlog(shard *s);
+void   shard_wake_all(void);
+
+#endif
@@ -0,0 +1,69 @@
+#include <string.h>  // memcpy()
+#include "alloc.h"
+#include "spscring.h"
+
+// Creates a ring holding at least 'capacity' items of 'itemsize' bytes each.
+spscring *spscring_new(size_t capacity, size_t itemsize)
+{
+  // Round capacity up to a power of two so indices can be masked
+  size_t size = 1;
+  while (size < capacity)
+    size <<= 1;
+
+  spscring *r = xmalloc_zero(sizeof(spscring));
+
+  r->capacity = size;
+  r->itemsize = itemsize;
+  r->items    = xmalloc(size * itemsize);
+  r->head     = 0;
+  r->tail     = 0;
+
+  return r;
+}
+
+// Copies an item into the ring. Must only be called by the producer thread.
+//  Returns false if the ring is full.
+bool spscring_push(spscring *r, const void *item)
+{
+  size_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+  if ((tail - head) >= r->capacity)
+    return false;  // Full
+
+  memcpy(r->items + ((tail & (r->capacity - 1)) * r->itemsize), item, r->itemsize);
+
+  // Publish the item
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+// Copies the oldest item out of the ring and removes it. Must only be called
+//  by the consumer thread. Returns false if the ring is empty.
+bool spscring_pop(spscring *r, void *item)
+{
+  size_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+  if (head == tail)
+    return false;  // Empty
+
+  memcpy(item, r->items + ((head & (r->capacity - 1)) * r->itemsize), r->itemsize);
+
+  // Release the slot back to the producer
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+bool spscring_is_empty(spscring *r)
+{
+  return (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+}
+
+void spscring_free(spscring *r)
+{
+  xfree(r->items);
+  xfree(r);
+}
@@ -0,0 +1,33 @@
+#include <stdlib.h>   // size_t
+#include <stdint.h>   // uint8_t
+#include <stdbool.h>
+
+#ifndef MINISTOMPD_SPSCRING_H
+#define MINISTOMPD_SPSCRING_H
+
+#define SPSCRING_CACHELINE 64
+
+// A bounded lock-free ring with exactly one producer thread and one consumer
+//  thread. Items are fixed-size and copied in and out by value.
+typedef struct
+{
+  size_t   capacity;  // Number of item slots, a power of two
+  size_t   itemsize;  // Bytes per item
+  uint8_t *items;     // Item storage
+
+  // The indices only ever increase; each is written by one side only and
+  //  lives on its own cache line to avoid false sharing.
+  uint8_t  pad0[SPSCRING_CACHELINE];
+  size_t   head;      // Next slot to pop, written by the consumer
+  uint8_t  pad1[SPSCRING_CACHELINE - sizeof(size_t)];
+  size_t   tail;      // Next slot to push, written by the producer
+  uint8_t  pad2[SPSCRING_CACHELINE - sizeof(size_t)];
+} spscring;
+
+spscring *spscring_new(size_t capacity, size_t itemsize);
+bool      spscring_push(spscring *r, const void *item);
+bool      spscring_pop(spscring *r, void *item);
+bool      spscring_is_empty(spscring *r);
+void      spscring_free(spscring *r);
+
+#endif
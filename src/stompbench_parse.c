@@ -0,0 +1,289 @@
+#include <sys/types.h>  // open()
+#include <sys/stat.h>   // open(), fstat()
+#include <sys/mman.h>   // mmap()
+#include <fcntl.h>      // open()
+#include <unistd.h>     // getopt(), close()
+#include <string.h>     // memcpy(), strtok()
+#include <time.h>       // clock_gettime()
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>  // __rdtsc()
+#endif
+#include "ministompd.h"
+
+// Replays a corpus of recorded STOMP traffic through the frame parser and
+//  serializer, to measure their throughput and catch regressions. The corpus
+//  is the raw bytes a client sent, as captured off the wire.
+
+#define BENCH_SEGMENTS_MAX       8
+#define BENCH_DEFAULT_ITERATIONS 10
+
+struct bench_result
+{
+  unsigned long frames;  // Frames handled
+  size_t        bytes;   // Bytes handled
+  double        secs;    // Wall clock time taken
+  uint64_t      cycles;  // Time stamp counter ticks taken, or 0 if unavailable
+  unsigned long allocs;  // Calls to xmalloc() and xrealloc()
+};
+
+static uint64_t bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static double bench_secs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void bench_start(struct bench_result *r)
+{
+  r->secs   = -bench_secs();
+  r->cycles = -bench_cycles();
+  r->allocs = -alloc_get_count();
+}
+
+static void bench_stop(struct bench_result *r)
+{
+  r->secs   += bench_secs();
+  r->cycles += bench_cycles();
+  r->allocs += alloc_get_count();
+}
+
+static void bench_report(const char *name, const struct bench_result *r)
+{
+  printf("%-16s %10.0f frames/s %9.1f MB/s %7.2f allocs/frame", name,
+   r->frames / r->secs, r->bytes / r->secs / (1024 * 1024),
+   r->frames ? ((double) r->allocs / r->frames) : 0.0);
+
+  if (r->cycles)
+    printf(" %8.2f cycles/byte", (double) r->cycles / r->bytes);
+
+  printf("\n");
+}
+
+// Feeds the corpus to a parser in reads of the given size, the way a
+//  connection would, and collects the finished frames. Content-length
+//  bodies are copied straight into their frames, as connection_pump_body()
+//  does. Returns the number of frames, or -1 on a parse error.
+static int bench_parse(const uint8_t *data, size_t length, size_t segment, frame **frames, int max)
+{
+  frameparser *fp = frameparser_new();
+  buffer *b = buffer_new(4096);
+  int count = 0;
+
+  size_t pos = 0;
+  while (pos < length)
+  {
+    size_t n = length - pos;
+    if (n > segment)
+      n = segment;
+
+    uint8_t *space;
+    size_t spacelen;
+    if (frameparser_get_body_space(fp, &space, &spacelen))
+    {
+      if (n > spacelen)
+        n = spacelen;
+      memcpy(space, data + pos, n);
+      frameparser_add_body_bytes(fp, n);
+    }
+    else
+      buffer_write_bytes(b, data + pos, n);
+
+    pos += n;
+
+    // Parse everything this read made available
+    frameparser_outcome outcome;
+    while ((outcome = frameparser_parse(fp, b)) == FP_OUTCOME_FRAME)
+    {
+      frame *f;
+      while ((f = frameparser_get_frame(fp)) != NULL)
+      {
+        if (count < max)
+          frames[count++] = f;
+        else
+          frame_free(f);
+      }
+    }
+
+    if (outcome == FP_OUTCOME_ERROR)
+    {
+      const bytestring *error = frameparser_get_error(fp);
+      log_printf(LOG_LEVEL_ERROR, "Parse error at byte %zu: %.*s\n", pos, (int) bytestring_get_length(error), (const char *) bytestring_get_bytes(error));
+      count = -1;
+      break;
+    }
+  }
+
+  buffer_free(b);
+  frameparser_free(fp);
+
+  return count;
+}
+
+// Serializes the frames into a buffer, draining it as a connection would.
+//  Returns the number of bytes produced.
+static size_t bench_serialize(frame **frames, int count)
+{
+  frameserializer *fs = frameserializer_new();
+  frameserializer_set_body_ref_min(fs, 0);  // Copy every body, so all the output is measured
+  buffer *b = buffer_new(65536);
+  size_t bytes = 0;
+
+  int next = 0;
+  while ((next < count) || frameserializer_has_work_frames(fs))
+  {
+    while ((next < count) && frameserializer_enqueue_frame(fs, frames[next], NULL))
+      next++;
+
+    frameserializer_serialize(fs, b);
+
+    bytes += buffer_get_length(b);
+    buffer_consume(b, buffer_get_length(b));
+
+    fs_completed_item item;
+    while (frameserializer_get_completed_frame(fs, &item))
+      frame_free(item.frame);
+  }
+
+  buffer_free(b);
+  frameserializer_free(fs);
+
+  return bytes;
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: stompbench-parse [-i iterations] [-s size[,size...]] corpus\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int iterations = BENCH_DEFAULT_ITERATIONS;
+  size_t segments[BENCH_SEGMENTS_MAX] = {1, 1500, 65536};  // Byte at a time, one MTU, large reads
+  int segcount = 3;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "i:s:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'i':
+      iterations = atoi(optarg);
+      if (iterations < 1)
+        usage();
+      break;
+    case 's':
+      segcount = 0;
+      for (char *tok = strtok(optarg, ","); tok; tok = strtok(NULL, ","))
+      {
+        if ((segcount == BENCH_SEGMENTS_MAX) || (atol(tok) < 1))
+          usage();
+        segments[segcount++] = atol(tok);
+      }
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if (optind != (argc - 1))
+    usage();
+
+  // Map in the corpus
+  int fd = open(argv[optind], O_RDONLY);
+  if (fd < 0)
+  {
+    log_perror(LOG_LEVEL_ERROR, "open()");
+    exit(1);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+  {
+    log_perror(LOG_LEVEL_ERROR, "fstat()");
+    exit(1);
+  }
+
+  size_t length = st.st_size;
+  if (length == 0)
+  {
+    log_printf(LOG_LEVEL_ERROR, "Corpus is empty.\n");
+    exit(1);
+  }
+
+  const uint8_t *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+  {
+    log_perror(LOG_LEVEL_ERROR, "mmap()");
+    exit(1);
+  }
+  close(fd);
+
+  bytescan_init();
+
+  // Every frame takes at least a command, a blank line and a NUL
+  int max = (length / 3) + 1;
+  frame **frames = xmalloc(sizeof(frame *) * max);
+
+  printf("Corpus: %zu bytes, %d iterations\n", length, iterations);
+
+  // Serializing doesn't depend on how the input was split up, so its
+  //  results are totalled over every pass
+  struct bench_result serialize = {0};
+
+  for (int i = 0; i < segcount; i++)
+  {
+    struct bench_result parse = {0};
+
+    for (int n = 0; n < iterations; n++)
+    {
+      struct bench_result r;
+
+      bench_start(&r);
+      int count = bench_parse(data, length, segments[i], frames, max);
+      bench_stop(&r);
+
+      if (count < 0)
+        exit(1);
+
+      parse.frames += count;
+      parse.bytes  += length;
+      parse.secs   += r.secs;
+      parse.cycles += r.cycles;
+      parse.allocs += r.allocs;
+
+      bench_start(&r);
+      size_t bytes = bench_serialize(frames, count);
+      bench_stop(&r);
+
+      serialize.frames += count;
+      serialize.bytes  += bytes;
+      serialize.secs   += r.secs;
+      serialize.cycles += r.cycles;
+      serialize.allocs += r.allocs;
+
+      for (int f = 0; f < count; f++)
+        frame_free(frames[f]);
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "parse/%zu", segments[i]);
+    bench_report(name, &parse);
+  }
+
+  bench_report("serialize", &serialize);
+
+  xfree(frames);
+  munmap((void *) data, length);
+
+  return 0;
+}
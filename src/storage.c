@@ -2,7 +2,8 @@
 
 static struct storage_funcs funcs[] =
 {
-  {init: &storage_memory_init, deinit: &storage_memory_deinit, enqueue: &storage_memory_enqueue}
+  {init: &storage_memory_init, deinit: &storage_memory_deinit, enqueue: &storage_memory_enqueue,
+   get_oldest_time: &storage_memory_get_oldest_time, expire: &storage_memory_expire}
 };
 
 // Does not take ownership of queue.
@@ -29,3 +30,16 @@ bool storage_enqueue(storage *s, frame *f)
   return (*funcs[s->type].enqueue)(s, f);
 }
 
+// Gets the time the oldest stored frame was stored. Returns false if the
+//  storage is empty.
+bool storage_get_oldest_time(storage *s, uint64_t *time)
+{
+  return (*funcs[s->type].get_oldest_time)(s, time);
+}
+
+// Drops every frame stored before the given time, returning how many.
+int storage_expire(storage *s, uint64_t before)
+{
+  return (*funcs[s->type].expire)(s, before);
+}
+
@@ -7,16 +7,22 @@
 typedef void storage_func_init(storage *s);
 typedef void storage_func_deinit(storage *s);
 typedef bool storage_func_enqueue(storage *s, frame *f);
+typedef bool storage_func_get_oldest_time(storage *s, uint64_t *time);
+typedef int  storage_func_expire(storage *s, uint64_t before);
 
 struct storage_funcs
 {
-  storage_func_init    *init;
-  storage_func_deinit  *deinit;
-  storage_func_enqueue *enqueue;
+  storage_func_init            *init;
+  storage_func_deinit          *deinit;
+  storage_func_enqueue         *enqueue;
+  storage_func_get_oldest_time *get_oldest_time;
+  storage_func_expire          *expire;
 };
 
 storage *storage_new(storage_type type, queue *q);
 void     storage_free(storage *s);
 bool     storage_enqueue(storage *s, frame *f);
+bool     storage_get_oldest_time(storage *s, uint64_t *time);
+int      storage_expire(storage *s, uint64_t before);
 
 #endif
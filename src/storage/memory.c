@@ -1,3 +1,5 @@
+#include <string.h>  // memmove()
+
 #include "../ministompd.h"
 
 static bool storage_memory_ensure_size(storage *s, int size)
@@ -40,6 +42,9 @@ void storage_memory_deinit(storage *s)
 {
   storage_memory *mem = s->u.memory;
 
+  for (int i = 0; i < mem->length; i++)
+    frame_free(mem->slots[i].frame);
+
   xfree(mem->slots);
   xfree(mem);
 
@@ -65,7 +70,50 @@ bool storage_memory_enqueue(storage *s, frame *f)
   int i = mem->length++;
   mem->slots[i].qlid        = mem->next_qlid++;
   mem->slots[i].rejectcount = 0;
+  mem->slots[i].storetime   = loopclock_now_ms();
   mem->slots[i].frame       = f;
 
   return true;
 }
+
+bool storage_memory_get_oldest_time(storage *s, uint64_t *time)
+{
+  storage_memory *mem = s->u.memory;
+
+  if (mem->length == 0)
+    return false;
+
+  *time = mem->slots[0].storetime;
+  return true;
+}
+
+// Drops frames stored before the given time. Slots are kept in store order,
+//  so the expired frames are all at the front. They are taken out of the
+//  queue's router first, together and oldest first; anything else still
+//  holding one keeps it alive with its own reference.
+int storage_memory_expire(storage *s, uint64_t before)
+{
+  storage_memory *mem = s->u.memory;
+
+  int count = 0;
+  while ((count < mem->length) && (mem->slots[count].storetime < before))
+    count++;
+
+  if (count == 0)
+    return 0;  // Nothing to expire
+
+  frame **frames = xmalloc(sizeof(frame *) * count);
+  for (int i = 0; i < count; i++)
+    frames[i] = mem->slots[i].frame;
+
+  framerouter_forget(s->queue->framerouter, frames, count);
+
+  for (int i = 0; i < count; i++)
+    frame_free(frames[i]);
+  xfree(frames);
+
+  mem->length -= count;
+  memmove(&mem->slots[0], &mem->slots[count], sizeof(storage_memory_slot) * mem->length);
+
+  return count;
+}
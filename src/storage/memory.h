@@ -7,6 +7,7 @@ typedef struct
 {
   queue_local_id qlid;
   int            rejectcount;  // Number of times the frame has been rejected by a consumer
+  uint64_t       storetime;    // Time the frame was stored, in milliseconds on the monotonic clock
   frame         *frame;
 } storage_memory_slot;
 
@@ -22,5 +23,7 @@ typedef struct storage_memory storage_memory;
 void storage_memory_init(storage *s);
 void storage_memory_deinit(storage *s);
 bool storage_memory_enqueue(storage *s, frame *f);
+bool storage_memory_get_oldest_time(storage *s, uint64_t *time);
+int  storage_memory_expire(storage *s, uint64_t before);
 
 #endif
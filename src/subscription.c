@@ -1,5 +1,21 @@
 #include "ministompd.h"
 
+// Hands a frame back to the queue's router when the client hasn't
+//  acknowledged it in time.
+static void subscription_redeliver(timer *t, void *data)
+{
+  struct delivery *d = data;
+  subscription *s = d->sub;
+
+  if ((d->status != DEL_STATUS_WRITE) && (d->status != DEL_STATUS_WAIT))
+    return;  // Already acknowledged or rejected
+
+  // The delivery's reference to the frame goes along with it
+  hash_remove(s->deliveries, d->msgid);
+  shard_redispatch(s, d->frame);
+  xfree(d);
+}
+
 // Creates a subscription for the given queue.
 // Does not take ownership of the queue or connection.
 // Takes ownership of client_id and server_id.
@@ -14,45 +30,92 @@ subscription *subscription_new(queue *queue, connection *connection, const bytes
   sub->ack_type    = ack_type;
   sub->deliveries  = hash_new(16);
   sub->next_seqnum = 0;
+  sub->held        = list_new(4);
+  sub->holding     = false;
 //  sub->last_qlid = 0;
 
   return sub;
 }
 
+// Sends a frame to the subscription's client. Takes over the caller's
+//  reference to the frame, which the delivery record keeps while the client
+//  has yet to acknowledge it.
 void subscription_deliver(subscription *s, frame *f)
 {
   // Get frame headers
   headerbundle *hb = frame_get_headerbundle(f);
 
-  // Get message's 'message-id' header
-  const bytestring *msgid = headerbundle_get_header_value_by_str(hb, "message-id");
-  assert(msgid != NULL);
+  // Get message's 'message-id' header. The frame may be shared with other
+  //  shards, so it is only read as stored; the router unescaped it before
+  //  dispatching the frame.
+  int escaped;
+  const bytestring *msgid = headerbundle_get_raw_header_value_by_atom(hb, HDR_MESSAGE_ID, &escaped);
+  assert((msgid != NULL) && !(escaped & HEADER_ESCAPED_VAL));
+
+  // Build the delivery's overlay headers. The frame itself may be shared
+  //  with other subscriptions, so it is never copied or changed.
+  headerbundle *overlay = headerbundle_new();
+  headerbundle_append_header(overlay, bytestring_new_from_string("subscription"), bytestring_dup(s->client_id));
+
+  // Generate 'ack' header, if the client has to acknowledge the frame
+  if (s->ack_type != SUBSCRIPTION_ACK_AUTO)
+  {
+    int subid_length = bytestring_get_length(s->server_id);
+    int msgid_length = bytestring_get_length(msgid);
+    int total_length = subid_length + 1 + msgid_length;
+    bytestring *ack = bytestring_new(total_length);
+    bytestring_append_bytestring(ack, s->server_id);
+    bytestring_append_byte(ack, '/');
+    bytestring_append_bytestring(ack, msgid);
+    headerbundle_append_header(overlay, bytestring_new_from_string("ack"), ack);
+  }
+
+  // Send to frame serializer. A frame going to many subscribers is sent from
+  //  its shared wire image, with only the overlay serialized here.
+  frameserializer *fs = s->connection->frameserializer;
+  int qid;
+  if (f->wire)
+    qid = frameserializer_enqueue_wireimage(fs, f, f->wire, overlay);
+  else
+    qid = frameserializer_enqueue_frame(fs, f, overlay);
+
+  // If the connection has no room, the frame goes back to the queue's
+  //  router, which holds it until the connection drains
+  if (qid == 0)
+  {
+    headerbundle_free(overlay);
+    connection_update_throttle(s->connection);
+    shard_redispatch(s, f);
+    return;
+  }
 
   // Create 'delivery' record
   struct delivery *d = xmalloc(sizeof(struct delivery));
+  d->sub    = s;
   d->frame  = f;
+  d->msgid  = msgid;
   d->seqnum = s->next_seqnum++;
   d->status = DEL_STATUS_WRITE;
-  if (clock_gettime(CLOCK_MONOTONIC, &d->createtime))
-    abort();  // Couldn't get time
-
-  // Generate 'ack' header
-  int subid_length = bytestring_get_length(s->server_id);
-  int msgid_length = bytestring_get_length(msgid);
-  int total_length = subid_length + 1 + msgid_length;
-  bytestring *ack = bytestring_new(total_length);
-  bytestring_append_bytestring(ack, s->server_id);
-  bytestring_append_byte(ack, '/');
-  bytestring_append_bytestring(ack, msgid);
-
-  // Build local headers
-  headerbundle *local_headers;
-  local_headers = headerbundle_new();
-  headerbundle_append_header(local_headers, bytestring_new_from_string("ack"), ack);
-
-  // Send to frame serializer
-  frameserializer *fs = s->connection->frameserializer;
-  frameserializer_enqueue_frame(fs, f, local_headers);
+  d->createtime = loopclock_now();
+  timer_init(&d->timer, subscription_redeliver, d);
+
+  // Only frames needing an ACK are tracked. The rest are done with once
+  //  they are queued for output, which holds its own reference.
+  if ((s->ack_type == SUBSCRIPTION_ACK_AUTO) || !hash_add(s->deliveries, msgid, d))
+  {
+    frame_free(f);
+    xfree(d);
+  }
+  else if (s->queue->config->ack_timeout > 0)
+  {
+    // Frames needing an ACK go back to the queue if it doesn't come in time
+    timerwheel *tw = s->connection->shard->timers;
+    timerwheel_schedule(tw, &d->timer, tw->now + s->queue->config->ack_timeout);
+  }
+
+  // The connection now has output pending
+  connection_touch(s->connection);
+  connection_update_throttle(s->connection);
 }
 
 void subscription_pump(subscription *s)
@@ -75,6 +138,19 @@ void subscription_dump(subscription *s)
 
 void subscription_free(subscription *sub)
 {
+  // Drop deliveries still waiting on the client
+  struct delivery *d;
+  while ((d = hash_remove_any(sub->deliveries, NULL)))
+  {
+    timerwheel_cancel(sub->connection->shard->timers, &d->timer);
+    frame_free(d->frame);
+    xfree(d);
+  }
+  hash_free(sub->deliveries);
+
+  // The router let go of anything held back when the subscription left it
+  list_free(sub->held);
+
   bytestring_free((bytestring *) sub->client_id);
   bytestring_free((bytestring *) sub->server_id);
   xfree(sub);
@@ -0,0 +1,228 @@
+#include "ministompd.h"
+
+#define TIMERWHEEL_SLOT_MASK (TIMERWHEEL_SLOTS - 1)
+
+// Time spanned by the whole wheel, beyond which timers are parked
+//  in the top level.
+#define TIMERWHEEL_SPAN ((uint64_t) 1 << (TIMERWHEEL_SLOT_BITS * TIMERWHEEL_LEVELS))
+
+timerwheel *timerwheel_new(uint64_t now)
+{
+  timerwheel *tw = xmalloc(sizeof(timerwheel));
+
+  tw->now   = now;
+  tw->count = 0;
+
+  for (int level = 0; level < TIMERWHEEL_LEVELS; level++)
+  {
+    for (int slot = 0; slot < TIMERWHEEL_SLOTS; slot++)
+    {
+      timer *head = &tw->slots[level][slot];
+      head->next = head;
+      head->prev = head;
+    }
+
+    tw->occupied[level] = 0;
+  }
+
+  return tw;
+}
+
+void timer_init(timer *t, timer_func *func, void *data)
+{
+  t->next    = NULL;
+  t->prev    = NULL;
+  t->expiry  = 0;
+  t->func    = func;
+  t->data    = data;
+  t->pending = false;
+}
+
+// Links a timer into the slot for its expiry, relative to the wheel's
+//  current time. A timer expiring right now goes in the current tick's slot,
+//  which is only fired again if the wheel is part way through that tick.
+static void timerwheel_insert(timerwheel *tw, timer *t)
+{
+  uint64_t delta = t->expiry - tw->now;
+
+  // Find the lowest level whose span covers the expiry
+  int level = 0;
+  while ((level < (TIMERWHEEL_LEVELS - 1)) && (delta >= ((uint64_t) 1 << (TIMERWHEEL_SLOT_BITS * (level + 1)))))
+    level++;
+
+  // Timers beyond the wheel's span wait in the furthest top-level slot
+  uint64_t when = t->expiry;
+  if (delta >= TIMERWHEEL_SPAN)
+    when = tw->now + TIMERWHEEL_SPAN - 1;
+
+  int slot = (when >> (TIMERWHEEL_SLOT_BITS * level)) & TIMERWHEEL_SLOT_MASK;
+
+  timer *head = &tw->slots[level][slot];
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+
+  tw->occupied[level] |= ((uint64_t) 1 << slot);
+}
+
+// Unlinks a timer from its slot, clearing the slot's occupied bit if it
+//  became empty.
+static void timerwheel_unlink(timerwheel *tw, timer *t)
+{
+  timer *next = t->next;
+
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = NULL;
+  t->prev = NULL;
+
+  // An empty slot list points back at its own head
+  if (next->next == next)
+  {
+    int offset = next - &tw->slots[0][0];
+    if ((offset >= 0) && (offset < (TIMERWHEEL_LEVELS * TIMERWHEEL_SLOTS)))
+      tw->occupied[offset / TIMERWHEEL_SLOTS] &= ~((uint64_t) 1 << (offset % TIMERWHEEL_SLOTS));
+  }
+}
+
+// Schedules a timer to fire at the given time, replacing any earlier
+//  schedule for it.
+void timerwheel_schedule(timerwheel *tw, timer *t, uint64_t expiry)
+{
+  if (t->pending)
+    timerwheel_unlink(tw, t);
+  else
+    tw->count++;
+
+  // Anything already due fires on the next tick
+  if (expiry <= tw->now)
+    expiry = tw->now + 1;
+
+  t->expiry  = expiry;
+  t->pending = true;
+  timerwheel_insert(tw, t);
+}
+
+// Cancels a timer. Does nothing if it is not pending.
+void timerwheel_cancel(timerwheel *tw, timer *t)
+{
+  if (!t->pending)
+    return;
+
+  timerwheel_unlink(tw, t);
+  t->pending = false;
+  tw->count--;
+}
+
+// Returns the earliest time after the wheel's current time at which some slot
+//  needs attention, or UINT64_MAX if the wheel is empty.
+static uint64_t timerwheel_next_event(timerwheel *tw)
+{
+  uint64_t next = UINT64_MAX;
+
+  for (int level = 0; level < TIMERWHEEL_LEVELS; level++)
+  {
+    uint64_t bits = tw->occupied[level];
+    if (bits == 0)
+      continue;
+
+    // Find the first occupied slot after the current one, in wheel order
+    int shift = TIMERWHEEL_SLOT_BITS * level;
+    uint64_t index = tw->now >> shift;
+    int start = (index + 1) & TIMERWHEEL_SLOT_MASK;
+    uint64_t rotated = (start == 0) ? bits : ((bits >> start) | (bits << (TIMERWHEEL_SLOTS - start)));
+    int distance = __builtin_ctzll(rotated) + 1;
+
+    uint64_t when = (index + distance) << shift;
+    if (when < next)
+      next = when;
+  }
+
+  return next;
+}
+
+// Moves every timer in the given slot down to the level its expiry now
+//  belongs in.
+static void timerwheel_cascade(timerwheel *tw, int level, int slot)
+{
+  timer *head = &tw->slots[level][slot];
+
+  // Detach the whole list first, as timers may land back in this slot
+  timer *t = head->next;
+  head->prev->next = NULL;
+  head->next = head;
+  head->prev = head;
+  tw->occupied[level] &= ~((uint64_t) 1 << slot);
+
+  while (t)
+  {
+    timer *next = t->next;
+    timerwheel_insert(tw, t);
+    t = next;
+  }
+}
+
+// Advances the wheel to the given time, firing every timer due by then in
+//  order of expiry. Callbacks may schedule or cancel timers freely.
+void timerwheel_advance(timerwheel *tw, uint64_t now)
+{
+  while (tw->now < now)
+  {
+    // Skip straight over stretches with nothing to do
+    uint64_t next = timerwheel_next_event(tw);
+    if (next > now)
+    {
+      tw->now = now;
+      return;
+    }
+
+    tw->now = next;
+
+    // Bring down timers from higher levels whose slot has come round
+    for (int level = TIMERWHEEL_LEVELS - 1; level > 0; level--)
+    {
+      int shift = TIMERWHEEL_SLOT_BITS * level;
+      if ((tw->now & (((uint64_t) 1 << shift) - 1)) != 0)
+        continue;  // Not at a slot boundary for this level
+
+      int slot = (tw->now >> shift) & TIMERWHEEL_SLOT_MASK;
+      if (tw->occupied[level] & ((uint64_t) 1 << slot))
+        timerwheel_cascade(tw, level, slot);
+    }
+
+    // Fire everything in this tick's slot
+    timer *head = &tw->slots[0][tw->now & TIMERWHEEL_SLOT_MASK];
+    while (head->next != head)
+    {
+      timer *t = head->next;
+      timerwheel_unlink(tw, t);
+      t->pending = false;
+      tw->count--;
+
+      (*t->func)(t, t->data);
+    }
+  }
+}
+
+// Returns the number of milliseconds from the given time until the next timer
+//  is due, for use as a poll timeout. Returns -1 if no timers are pending.
+int timerwheel_get_timeout(timerwheel *tw, uint64_t now)
+{
+  if (tw->count == 0)
+    return -1;  // Nothing to wait for
+
+  uint64_t next = timerwheel_next_event(tw);
+  if (next <= now)
+    return 0;
+  else if ((next - now) > INT32_MAX)
+    return INT32_MAX;
+
+  return next - now;
+}
+
+// Does not fire or free any timers still pending.
+void timerwheel_free(timerwheel *tw)
+{
+  xfree(tw);
+}
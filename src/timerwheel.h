@@ -0,0 +1,46 @@
+#include <stdint.h>   // uint64_t
+#include <stdbool.h>
+
+#ifndef MINISTOMPD_TIMERWHEEL_H
+#define MINISTOMPD_TIMERWHEEL_H
+
+#define TIMERWHEEL_LEVELS     4   // 64^4 ms is about 4.6 hours; longer timers are re-cascaded
+#define TIMERWHEEL_SLOT_BITS  6
+#define TIMERWHEEL_SLOTS      (1 << TIMERWHEEL_SLOT_BITS)
+
+struct timer;
+typedef void timer_func(struct timer *t, void *data);
+
+// A timer is embedded in whatever it times, so scheduling and cancelling
+//  never allocate. Times are in milliseconds on the monotonic clock.
+typedef struct timer
+{
+  struct timer *next;     // Next timer in the same slot
+  struct timer *prev;     // Previous timer in the same slot
+  uint64_t      expiry;   // Time at which the timer fires
+  timer_func   *func;     // Called when the timer fires
+  void         *data;     // Passed to func
+  bool          pending;  // Scheduled and not yet fired or cancelled
+} timer;
+
+// Hierarchical timing wheel. Level n has slots one 64^n ms tick wide. Timers
+//  sit in the lowest level whose span covers their expiry, and move down a
+//  level each time the wheel reaches their slot. A bitmap of occupied slots
+//  per level finds the next deadline without walking empty slots.
+typedef struct
+{
+  uint64_t now;                                       // Time the wheel has been advanced to
+  int      count;                                     // Number of pending timers
+  timer    slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];  // List heads
+  uint64_t occupied[TIMERWHEEL_LEVELS];               // Bit n set iff slot n is non-empty
+} timerwheel;
+
+timerwheel *timerwheel_new(uint64_t now);
+void        timer_init(timer *t, timer_func *func, void *data);
+void        timerwheel_schedule(timerwheel *tw, timer *t, uint64_t expiry);
+void        timerwheel_cancel(timerwheel *tw, timer *t);
+void        timerwheel_advance(timerwheel *tw, uint64_t now);
+int         timerwheel_get_timeout(timerwheel *tw, uint64_t now);
+void        timerwheel_free(timerwheel *tw);
+
+#endif
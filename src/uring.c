@@ -0,0 +1,526 @@
+#define _GNU_SOURCE  // syscall()
+
+#include <string.h>  // memset()
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>  // uintptr_t
+#include <sys/epoll.h>
+#include "ministompd.h"
+
+#ifdef MINISTOMPD_IO_URING
+
+#include <sys/mman.h>     // mmap()
+#include <sys/syscall.h>  // __NR_io_uring_*
+#include <sys/socket.h>   // MSG_NOSIGNAL
+#include <linux/io_uring.h>
+
+// Operation tags, stored in the low bits of each SQE's user_data alongside
+//  the (suitably aligned) connection pointer.
+#define URING_OP_RECV 0x1
+#define URING_OP_SEND 0x2
+#define URING_OP_MASK 0x3
+
+struct uring
+{
+  int                       fd;          // io_uring instance
+
+  void                     *sq_ptr;      // Mapped submission ring
+  size_t                    sq_len;
+  unsigned int             *sq_head;
+  unsigned int             *sq_tail;
+  unsigned int             *sq_flags;
+  unsigned int             *sq_mask;
+  unsigned int             *sq_array;
+  unsigned int              sq_entries;
+  unsigned int              sq_local_tail;  // Tail including SQEs not yet published
+  unsigned int              sq_queued;      // SQEs queued since the last submit
+
+  struct io_uring_sqe      *sqes;        // Mapped submission queue entries
+  size_t                    sqes_len;
+
+  void                     *cq_ptr;      // Mapped completion ring
+  size_t                    cq_len;
+  unsigned int             *cq_head;
+  unsigned int             *cq_tail;
+  unsigned int             *cq_mask;
+  struct io_uring_cqe      *cqes;
+
+  struct io_uring_buf_ring *br;          // Provided buffer ring for receives
+  size_t                    br_len;
+  uint16_t                  br_tail;     // Local copy of the ring tail
+  uint8_t                  *br_data;     // Backing memory for the provided buffers
+
+  list                     *stalled;     // Connections with operations waiting for a free SQE
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Hands the provided buffer with the given id back to the kernel.
+static void uring_recycle_buffer(uring *u, uint16_t bid)
+{
+  struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (URING_RECV_BUF_COUNT - 1)];
+  buf->addr = (uintptr_t) (u->br_data + ((size_t) bid * NETWORK_READ_SIZE));
+  buf->len  = NETWORK_READ_SIZE;
+  buf->bid  = bid;
+
+  u->br_tail++;
+  __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+// Returns the number of SQEs that can be queued without submitting first.
+static unsigned int uring_get_free_sqes(uring *u)
+{
+  unsigned int head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+  return u->sq_entries - (u->sq_local_tail - head);
+}
+
+// Submits every SQE queued since the last call with a single syscall. If the
+//  kernel pushes back, they stay queued for the next try.
+static void uring_submit_queued(uring *u)
+{
+  if (u->sq_queued == 0)
+    return;  // Nothing to do
+
+  __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+
+  int ret = uring_enter(u->fd, u->sq_queued, 0, 0);
+  if (ret < 0)
+  {
+    int error = errno;
+    if ((error == EINTR) || (error == EAGAIN) || (error == EBUSY))
+      return;  // Retry on the next tick
+
+    log_perror(LOG_LEVEL_ERROR, "io_uring_enter()");
+    exit(1);
+  }
+
+  u->sq_queued -= ret;
+}
+
+// Returns a zeroed SQE to fill in, submitting queued entries first if the
+//  submission ring is full. Returns NULL if the kernel would not take any of
+//  them, in which case the caller should stall its operation.
+static struct io_uring_sqe *uring_get_sqe(uring *u)
+{
+  if (uring_get_free_sqes(u) == 0)
+  {
+    uring_submit_queued(u);
+
+    if (uring_get_free_sqes(u) == 0)
+      return NULL;  // Kernel did not consume anything
+  }
+
+  unsigned int index = u->sq_local_tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[index] = index;
+
+  u->sq_local_tail++;
+  u->sq_queued++;
+
+  return sqe;
+}
+
+// Holds back an operation that found the submission ring full, until a later
+//  submit frees up room for it. It still counts as in flight, so that the
+//  connection isn't reaped in the meantime.
+static void uring_stall(uring *u, connection *c, int op)
+{
+  if (c->uring_stalled == 0)
+    list_push(u->stalled, c);
+
+  c->uring_stalled |= op;
+}
+
+// Queues a multishot receive on the connection. Each completion carries one
+//  of the provided buffers.
+static void uring_queue_recv(uring *u, connection *c)
+{
+  c->uring_ops++;
+
+  struct io_uring_sqe *sqe = uring_get_sqe(u);
+  if (!sqe)
+  {
+    uring_stall(u, c, URING_OP_RECV);
+    return;
+  }
+
+  sqe->opcode    = IORING_OP_RECV;
+  sqe->fd        = c->fd;
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_RECV_BUF_GROUP;
+  sqe->user_data = (uintptr_t) c | URING_OP_RECV;
+}
+
+// Queues a send of whatever remains in the connection's send buffer.
+static void uring_queue_send(uring *u, connection *c)
+{
+  c->uring_ops++;
+  c->uring_sending = true;
+
+  struct io_uring_sqe *sqe = uring_get_sqe(u);
+  if (!sqe)
+  {
+    uring_stall(u, c, URING_OP_SEND);
+    return;
+  }
+
+  sqe->opcode    = IORING_OP_SEND;
+  sqe->fd        = c->fd;
+  sqe->addr      = (uintptr_t) (c->sendbuffer->data + c->sendbuffer->position);
+  sqe->len       = buffer_get_length(c->sendbuffer);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uintptr_t) c | URING_OP_SEND;
+}
+
+// Queues stalled operations again, for as long as there is room for them.
+//  Operations on connections that have closed since are dropped.
+static void uring_retry_stalled(uring *u)
+{
+  // A connection can have both a receive and a send stalled
+  while ((list_get_length(u->stalled) > 0) && (uring_get_free_sqes(u) >= 2))
+  {
+    connection *c = list_shift(u->stalled);
+    int ops = c->uring_stalled;
+    c->uring_stalled = 0;
+
+    if (ops & URING_OP_RECV)
+    {
+      c->uring_ops--;
+      if (c->status != CONNECTION_STATUS_CLOSED)
+        uring_queue_recv(u, c);
+    }
+
+    if (ops & URING_OP_SEND)
+    {
+      c->uring_ops--;
+      c->uring_sending = false;
+      if (c->status != CONNECTION_STATUS_CLOSED)
+        uring_queue_send(u, c);
+    }
+
+    if (c->status == CONNECTION_STATUS_CLOSED)
+      connection_touch(c);  // May be ready to reap
+  }
+}
+
+uring *uring_new(unsigned int entries)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  int fd = uring_setup(entries, &p);
+  if (fd < 0)
+  {
+    log_perror(LOG_LEVEL_ERROR, "io_uring_setup()");
+    return NULL;
+  }
+
+  // Multishot receives need provided buffer rings, which came later than
+  //  the single mmap feature, so insist on it to keep the mapping simple
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+  {
+    log_printf(LOG_LEVEL_ERROR, "io_uring is too old for this engine.\n");
+    close(fd);
+    return NULL;
+  }
+
+  uring *u = xmalloc_zero(sizeof(uring));
+  u->fd = fd;
+
+  // Map the rings. With IORING_FEAT_SINGLE_MMAP, one mapping covers both.
+  u->sq_len = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+  u->cq_len = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+  if (u->cq_len > u->sq_len)
+    u->sq_len = u->cq_len;
+
+  u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+  if (u->sq_ptr == MAP_FAILED)
+  {
+    log_perror(LOG_LEVEL_ERROR, "mmap()");
+    close(fd);
+    xfree(u);
+    return NULL;
+  }
+  u->cq_ptr = u->sq_ptr;
+
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+  {
+    log_perror(LOG_LEVEL_ERROR, "mmap()");
+    munmap(u->sq_ptr, u->sq_len);
+    close(fd);
+    xfree(u);
+    return NULL;
+  }
+
+  uint8_t *sq = u->sq_ptr;
+  u->sq_head       = (unsigned int *) (sq + p.sq_off.head);
+  u->sq_tail       = (unsigned int *) (sq + p.sq_off.tail);
+  u->sq_flags      = (unsigned int *) (sq + p.sq_off.flags);
+  u->sq_mask       = (unsigned int *) (sq + p.sq_off.ring_mask);
+  u->sq_array      = (unsigned int *) (sq + p.sq_off.array);
+  u->sq_entries    = p.sq_entries;
+  u->sq_local_tail = *u->sq_tail;
+  u->sq_queued     = 0;
+
+  uint8_t *cq = u->cq_ptr;
+  u->cq_head = (unsigned int *) (cq + p.cq_off.head);
+  u->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+  u->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+  u->cqes    = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  u->stalled = list_new(16);
+
+  // Set up the provided buffer ring. The ring itself must be page aligned.
+  u->br_len = URING_RECV_BUF_COUNT * sizeof(struct io_uring_buf);
+  u->br = mmap(NULL, u->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (u->br == MAP_FAILED)
+  {
+    log_perror(LOG_LEVEL_ERROR, "mmap()");
+    u->br = NULL;
+    uring_free(u);
+    return NULL;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr    = (uintptr_t) u->br;
+  reg.ring_entries = URING_RECV_BUF_COUNT;
+  reg.bgid         = URING_RECV_BUF_GROUP;
+  if (uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+  {
+    log_perror(LOG_LEVEL_ERROR, "io_uring_register()");
+    uring_free(u);
+    return NULL;
+  }
+
+  u->br_data = xmalloc((size_t) URING_RECV_BUF_COUNT * NETWORK_READ_SIZE);
+  u->br_tail = 0;
+  for (int i = 0; i < URING_RECV_BUF_COUNT; i++)
+    uring_recycle_buffer(u, i);
+
+  return u;
+}
+
+// Registers the ring fd with the given epoll instance, so that the event
+//  loop wakes up when completions are waiting. The uring itself is used as
+//  the event's data pointer.
+bool uring_watch(uring *u, int epollfd)
+{
+  struct epoll_event ev;
+  ev.events   = EPOLLIN;
+  ev.data.ptr = u;
+
+  return (epoll_ctl(epollfd, EPOLL_CTL_ADD, u->fd, &ev) == 0);
+}
+
+// Hands a new connection over to the engine, arming its multishot receive.
+void uring_add_connection(uring *u, connection *c)
+{
+  // The kernel polls internally; a non-blocking fd would only produce
+  //  spurious EAGAIN completions
+  int flags = fcntl(c->fd, F_GETFL);
+  if (fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK) == -1)
+  {
+    log_perror(LOG_LEVEL_ERROR, "fcntl()");
+    exit(1);
+  }
+
+  c->uring      = u;
+  c->sendbuffer = buffer_new(4096);
+
+  // Sends only ever come from the buffer, so bodies must be copied into it
+  frameserializer_set_body_ref_min(c->frameserializer, 0);
+
+  uring_queue_recv(u, c);
+}
+
+// Queues a send of the connection's pending output, unless one is already
+//  in flight. The output buffer is swapped with the (empty) send buffer so
+//  that serialization can carry on while the kernel owns the bytes.
+void uring_send(uring *u, connection *c)
+{
+  if (c->uring_sending || (c->status == CONNECTION_STATUS_CLOSED))
+    return;
+  else if (buffer_get_length(c->outbuffer) == 0)
+    return;  // Nothing to send
+
+  buffer *b = c->sendbuffer;
+  c->sendbuffer = c->outbuffer;
+  c->outbuffer = b;
+
+  uring_queue_send(u, c);
+}
+
+static void uring_complete_recv(uring *u, connection *c, struct io_uring_cqe *cqe, list *ready)
+{
+  bool more = (cqe->flags & IORING_CQE_F_MORE);
+  if (!more)
+    c->uring_ops--;
+
+  if (cqe->res > 0)
+  {
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    connection_complete_input(c, u->br_data + ((size_t) bid * NETWORK_READ_SIZE), cqe->res);
+    uring_recycle_buffer(u, bid);
+  }
+  else if (cqe->res != -ENOBUFS)
+  {
+    // EOF or a socket error; running out of buffers is only transient
+    connection_complete_input(c, NULL, cqe->res);
+  }
+
+  // Re-arm the receive if the kernel stopped it on a live connection
+  if (!more && (c->status != CONNECTION_STATUS_CLOSED))
+    uring_queue_recv(u, c);
+
+  if (c->status == CONNECTION_STATUS_CLOSED)
+    connection_touch(c);  // May be ready to reap
+  else if (cqe->res > 0)
+    list_push(ready, c);
+}
+
+static void uring_complete_send(uring *u, connection *c, struct io_uring_cqe *cqe)
+{
+  c->uring_ops--;
+  c->uring_sending = false;
+
+  connection_complete_output(c, cqe->res);
+
+  // Resume a partial send; otherwise let the loop pick up anything that
+  //  was serialized in the meantime
+  if ((c->status != CONNECTION_STATUS_CLOSED) && (buffer_get_length(c->sendbuffer) > 0))
+    uring_queue_send(u, c);
+  else
+    connection_touch(c);
+}
+
+// Drains the completion ring. Connections that received data are pushed
+//  onto the 'ready' list for input handling.
+void uring_process_completions(uring *u, list *ready)
+{
+  while (true)
+  {
+    unsigned int head = *u->cq_head;
+    unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+      struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+
+      connection *c = (connection *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+      if ((cqe->user_data & URING_OP_MASK) == URING_OP_RECV)
+        uring_complete_recv(u, c, cqe, ready);
+      else
+        uring_complete_send(u, c, cqe);
+
+      head++;
+    }
+
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+    // Completions that didn't fit in the ring are held by the kernel, which
+    //  refuses new submissions until they are flushed into the ring
+    if (!(__atomic_load_n(u->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+      break;
+
+    if ((uring_enter(u->fd, 0, 0, IORING_ENTER_GETEVENTS) < 0) && (errno != EINTR) && (errno != EBUSY))
+    {
+      log_perror(LOG_LEVEL_ERROR, "io_uring_enter()");
+      exit(1);
+    }
+  }
+}
+
+// Submits every SQE queued since the last call with a single syscall,
+//  along with any stalled operations that now fit.
+void uring_submit(uring *u)
+{
+  uring_retry_stalled(u);
+  uring_submit_queued(u);
+}
+
+// Returns true iff operations are still waiting to be taken by the kernel,
+//  so that the loop should come back to submit them soon.
+bool uring_has_backlog(uring *u)
+{
+  return (u->sq_queued > 0) || (list_get_length(u->stalled) > 0);
+}
+
+void uring_free(uring *u)
+{
+  if (u->br)
+    munmap(u->br, u->br_len);
+  if (u->br_data)
+    xfree(u->br_data);
+
+  munmap(u->sqes, u->sqes_len);
+  munmap(u->sq_ptr, u->sq_len);
+  close(u->fd);
+  list_free(u->stalled);
+  xfree(u);
+}
+
+#else
+
+// Stubs for builds without io_uring support
+
+uring *uring_new(unsigned int entries)
+{
+  log_printf(LOG_LEVEL_ERROR, "io_uring support was not compiled in.\n");
+  return NULL;
+}
+
+bool uring_watch(uring *u, int epollfd)
+{
+  abort();
+}
+
+void uring_add_connection(uring *u, connection *c)
+{
+  abort();
+}
+
+void uring_send(uring *u, connection *c)
+{
+  abort();
+}
+
+void uring_process_completions(uring *u, list *ready)
+{
+  abort();
+}
+
+void uring_submit(uring *u)
+{
+  abort();
+}
+
+bool uring_has_backlog(uring *u)
+{
+  abort();
+}
+
+void uring_free(uring *u)
+{
+  abort();
+}
+
+#endif
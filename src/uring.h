@@ -0,0 +1,32 @@
+#include <stdbool.h>
+
+#include "list.h"
+
+#ifndef MINISTOMPD_URING_H
+#define MINISTOMPD_URING_H
+
+typedef enum
+{
+  IO_ENGINE_POSIX,  // Readiness from epoll, then read()/write() per event
+  IO_ENGINE_URING   // Multishot receives and batched sends through io_uring
+} io_engine;
+
+#define URING_QUEUE_DEPTH    1024  // Submission queue entries
+#define URING_RECV_BUF_COUNT 512   // Provided receive buffers, must be a power of two
+#define URING_RECV_BUF_GROUP 0     // Buffer group id for the provided buffer ring
+
+struct uring;
+typedef struct uring uring;
+
+struct connection;
+
+uring *uring_new(unsigned int entries);
+bool   uring_watch(uring *u, int epollfd);
+void   uring_add_connection(uring *u, struct connection *c);
+void   uring_send(uring *u, struct connection *c);
+void   uring_process_completions(uring *u, list *ready);
+void   uring_submit(uring *u);
+bool   uring_has_backlog(uring *u);
+void   uring_free(uring *u);
+
+#endif